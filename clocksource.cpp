@@ -0,0 +1,81 @@
+/*
+*************************************
+* clocksource.cpp:
+*   Find and map the Raspberry Pi's 1 MHz system timer
+*************************************
+*/
+
+#include <stdio.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "clocksource.h"
+#include "rtlog.h"
+
+clockSource::clockSource()
+{
+    fd = -1;
+    mapBase = MAP_FAILED;
+    stRegs = NULL;
+    periBase = 0;
+}
+
+clockSource::~clockSource()
+{
+    if (mapBase != MAP_FAILED)
+        munmap(mapBase, 4096);
+    if (fd >= 0)
+        close(fd);
+}
+
+// Read a big endian 32 bit cell from the device tree...
+static bool readCell(FILE *fp, long offset, unsigned long long *value)
+{
+    unsigned char buf[4];
+    if (fseek(fp, offset, SEEK_SET) || fread(buf, 1, sizeof(buf), fp) != sizeof(buf))
+        return(false);
+    *value = ((unsigned long long)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+    return(true);
+}
+
+// Work out where the peripherals live from the device tree's soc ranges.
+// Pi 1 - 3 have a one cell parent address at offset 4, the Pi 4 has a two
+// cell parent address so the low word is at offset 8...
+unsigned long long clockSource::detectPeripheralBase(void)
+{
+    unsigned long long base = 0;
+    FILE *fp = fopen(DT_SOC_RANGES, "rb");
+    if (fp) {
+        if (readCell(fp, 4, &base) && base == 0)
+            readCell(fp, 8, &base);
+        fclose(fp);
+    }
+    return(base ? base : PI1_PERI_BASE);
+}
+
+// Map the system timer into our memory space.
+// Returns false (and leaves us on CLOCK_MONOTONIC_RAW) if we can't...
+// From: http://mindplusplus.wordpress.com/2013/05/21/accessing-the-raspberry-pis-1mhz-timer/
+bool clockSource::init(void)
+{
+    periBase = detectPeripheralBase();
+    // Set up access to the system core memory...
+    if (-1 == (fd = open("/dev/mem", O_RDONLY | O_SYNC))) {
+        rtLog(LOG_WARN, "clockSource: can't open /dev/mem, using %s", name());
+        return(false);
+    }
+    //  Map the timer's page into the process' address space...
+    mapBase = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, (off_t)(periBase + ST_OFFSET));
+    if (MAP_FAILED == mapBase) {
+        rtLog(LOG_WARN, "clockSource: mmap() failed, using %s", name());
+        close(fd);
+        fd = -1;
+        return(false);
+    }
+    stRegs = (volatile unsigned int *)mapBase;
+    return(true);
+}
@@ -0,0 +1,53 @@
+#ifndef CLOCKSOURCE_H
+#define CLOCKSOURCE_H
+
+#include <time.h>
+
+#define DT_SOC_RANGES       "/proc/device-tree/soc/ranges"
+#define PI1_PERI_BASE       (0x20000000)    // Used if the device tree doesn't tell us
+#define ST_OFFSET           (0x3000)        // System timer offset from the peripheral base
+#define ST_CLO              (0x04 / 4)      // Counter low 32 bits (register index)
+#define ST_CHI              (0x08 / 4)      // Counter high 32 bits (register index)
+
+// 1 MHz time source for the stepper engine.
+// Uses the BCM283x free running system timer when we can map it, otherwise falls
+// back to CLOCK_MONOTONIC_RAW (a vDSO call, no syscall on current kernels)...
+class clockSource {
+private:
+    int fd;
+    void *mapBase;
+    volatile unsigned int *stRegs;
+    unsigned long long periBase;
+
+public:
+    clockSource();
+    ~clockSource();
+    bool init(void);
+    static unsigned long long detectPeripheralBase(void);
+    bool isHardware(void) { return(stRegs != NULL); }
+    const char *name(void) { return(stRegs ? "BCM system timer" : "CLOCK_MONOTONIC_RAW"); }
+    unsigned long long getPeripheralBase(void) { return(periBase); }
+    inline long long int read(void);
+};
+
+// Current time in uS.
+// The hardware counter is two 32 bit registers, so read high/low/high and
+// re-read the low word if the high word changed underneath us...
+inline long long int clockSource::read(void)
+{
+    if (stRegs) {
+        unsigned int hi = stRegs[ST_CHI];
+        unsigned int lo = stRegs[ST_CLO];
+        unsigned int hi2 = stRegs[ST_CHI];
+        if (hi != hi2) {
+            lo = stRegs[ST_CLO];
+            hi = hi2;
+        }
+        return(((long long int)hi << 32) | lo);
+    }
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_RAW, &ts);
+    return((long long int)ts.tv_sec * 1000000LL + ts.tv_nsec / 1000);
+}
+
+#endif // CLOCKSOURCE_H
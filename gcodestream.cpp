@@ -0,0 +1,292 @@
+/*
+*************************************
+* gcodestream.cpp:
+*   Turn G-code files into stepper programs
+*   a chunk at a time, however big they are
+*************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <math.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "gcodestream.h"
+#include "rtlog.h"
+
+// Parse a number (no exponents, G-code doesn't have them), false if there isn't one...
+static bool parseNumber(const char **pp, const char *end, double *value)
+{
+    const char *p = *pp;
+    while (p < end && (*p == ' ' || *p == '\t')) p++;
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = (*p == '-');
+        p++;
+    }
+    double result = 0.0, scale = 1.0;
+    bool digits = false, fraction = false;
+    for (; p < end; p++) {
+        if (*p >= '0' && *p <= '9') {
+            if (fraction) {
+                scale *= 0.1;
+                result += (*p - '0') * scale;
+            }
+            else
+                result = result * 10.0 + (*p - '0');
+            digits = true;
+        }
+        else if (*p == '.' && !fraction)
+            fraction = true;
+        else
+            break;
+    }
+    if (!digits)
+        return(false);
+    *value = negative?-result:result;
+    *pp = p;
+    return(true);
+}
+
+gcodeStream::gcodeStream()
+{
+    fileName[0] = 0;
+    fd = -1;
+    data = NULL;
+    size = 0;
+    offset = 0;
+    released = 0;
+    chunkDuration = 0.0;
+}
+
+gcodeStream::~gcodeStream()
+{
+    close();
+}
+
+// Map a G-code file and start reading it with the motors at startPos (mm)...
+bool gcodeStream::open(const char *path, const double startPos[NUM_MOTORS], const double axisStepsPerMM[NUM_MOTORS])
+{
+    close();
+    snprintf(fileName, sizeof(fileName), "%s", path);
+    fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+        rtLog(LOG_ERROR, "Can't open G-code file %s", fileName);
+        return(false);
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        rtLog(LOG_ERROR, "G-code file %s is empty", fileName);
+        close();
+        return(false);
+    }
+    void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+        rtLog(LOG_ERROR, "Can't map G-code file %s", fileName);
+        close();
+        return(false);
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    data = (const char *)map;
+    size = st.st_size;
+    offset = 0;
+    released = 0;
+    lineNum = 0;
+    relative = false;
+    unitScale = 1.0;
+    feed = GCODE_DEFAULT_FEED;
+    motionMode = 0;
+    numWarnings = 0;
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        position[n] = startPos[n];
+        stepsPerMM[n] = axisStepsPerMM[n];
+    }
+    rtLog(LOG_INFO, "Reading G-code from %s (%lld bytes)", fileName, (long long int)size);
+    return(true);
+}
+
+void gcodeStream::close()
+{
+    if (data)
+        munmap((void *)data, size);
+    if (fd >= 0)
+        ::close(fd);
+    fd = -1;
+    data = NULL;
+    size = 0;
+    offset = 0;
+}
+
+// Parse enough blocks to keep the motors busy for minDuration (sec), but no more than
+// maxBlocks, into a program per motor (replacing what's in them).  Sizing chunks by time
+// means a run of short segments can't use up a program before the next one's queued.
+// Returns the number of blocks, 0 once we've run out of file...
+int gcodeStream::nextChunk(QVector<stepperProgramCmd> programs[NUM_MOTORS], double minDuration, int maxBlocks)
+{
+    for (int n = 0; n < NUM_MOTORS; n++)
+        programs[n].clear();
+    chunkDuration = 0.0;
+    int numBlocks = 0;
+    while (offset < size && numBlocks < maxBlocks && chunkDuration < minDuration) {
+        const char *line = data + offset;
+        const char *eol = (const char *)memchr(line, '\n', size - offset);
+        const char *end = eol?eol:(data + size);
+        offset = (end - data) + (eol?1:0);
+        lineNum++;
+        numBlocks += parseLine(line, end, programs);
+    }
+    // Don't hang on to pages we've finished with...
+    if (offset - released >= GCODE_RELEASE_BYTES) {
+        size_t pageSize = sysconf(_SC_PAGESIZE);
+        size_t upTo = (offset / pageSize) * pageSize;
+        madvise((void *)(data + released), upTo - released, MADV_DONTNEED);
+        released = upTo;
+    }
+    return(numBlocks);
+}
+
+void gcodeStream::warn(const char *what, char letter, double value)
+{
+    if (numWarnings++ < GCODE_MAX_WARNINGS)
+        rtLog(LOG_WARN, "G-code line %ld: %s %c%g", lineNum, what, letter, value);
+}
+
+// Parse one line, returns the number of blocks (0 or 1) it added to the programs...
+int gcodeStream::parseLine(const char *line, const char *end, QVector<stepperProgramCmd> programs[NUM_MOTORS])
+{
+    bool dwell = false;
+    bool axisSeen[NUM_MOTORS];
+    double axisValue[NUM_MOTORS];
+    double dwellP = -1.0, dwellS = -1.0;
+    for (int n = 0; n < NUM_MOTORS; n++)
+        axisSeen[n] = false;
+    const char *p = line;
+    while (p < end) {
+        char c = *p;
+        // Comments...
+        if (c == ';' || c == '%')
+            break;
+        if (c == '(') {
+            while (p < end && *p != ')') p++;
+            p++;
+            continue;
+        }
+        if (isspace((unsigned char)c)) {
+            p++;
+            continue;
+        }
+        char letter = toupper((unsigned char)c);
+        double value;
+        p++;
+        if (!isalpha((unsigned char)letter) || !parseNumber(&p, end, &value)) {
+            warn("Can't make sense of", c, 0.0);
+            return(0);
+        }
+        const char *axis = strchr(GCODE_AXES, letter);
+        if (axis && (axis - GCODE_AXES) < NUM_MOTORS) {
+            axisSeen[axis - GCODE_AXES] = true;
+            axisValue[axis - GCODE_AXES] = value;
+            continue;
+        }
+        switch (letter) {
+        case 'G':
+            switch ((int)(value * 10.0 + 0.5)) {
+            case 0:
+            case 10:
+                motionMode = (int)(value + 0.5);
+                break;
+            case 40:
+                dwell = true;
+                break;
+            case 200:
+                unitScale = 25.4;
+                break;
+            case 210:
+                unitScale = 1.0;
+                break;
+            case 900:
+                relative = false;
+                break;
+            case 910:
+                relative = true;
+                break;
+            default:
+                warn("Ignoring", letter, value);
+            }
+            break;
+        case 'F':
+            if (value > 0.0) feed = value * unitScale;
+            break;
+        case 'P':
+            dwellP = value;
+            break;
+        case 'S':
+            dwellS = value;
+            break;
+        case 'N':
+            break;
+        default:
+            warn("Ignoring", letter, value);
+        }
+    }
+    // G4 dwell, P or S in seconds...
+    if (dwell) {
+        double duration = (dwellP >= 0.0)?dwellP:dwellS;
+        if (duration <= 0.0)
+            return(0);
+        addBlock(position, duration, true, programs);
+        return(1);
+    }
+    // A G0/G1 move...
+    double target[NUM_MOTORS], length = 0.0;
+    bool anyAxis = false;
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        target[n] = position[n];
+        if (axisSeen[n]) {
+            target[n] = (relative?position[n]:0.0) + axisValue[n] * unitScale;
+            anyAxis = true;
+        }
+        length += (target[n] - position[n]) * (target[n] - position[n]);
+    }
+    if (!anyAxis || length == 0.0)
+        return(0);
+    length = sqrt(length);
+    double duration = length / ((motionMode == 0)?GCODE_RAPID_FEED:feed) * 60.0;
+    return(addBlock(target, duration, false, programs)?1:0);
+}
+
+// Add a block taking duration (sec) to every motor's program, ending up at target (mm).
+// Axes that don't get to a new step pause for the block instead.  Unless it's a dwell
+// a block where no axis gets to a new step isn't added (false), it just carries over...
+bool gcodeStream::addBlock(const double target[NUM_MOTORS], double duration, bool dwell, QVector<stepperProgramCmd> programs[NUM_MOTORS])
+{
+    stepperProgramCmd cmds[NUM_MOTORS];
+    bool anyMoves = false;
+    if (duration < GCODE_MIN_DURATION)
+        duration = GCODE_MIN_DURATION;
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        cmds[n].duration = duration;
+        cmds[n].accel = GCODE_ACCEL;
+        cmds[n].loopStart = 0;
+        if (floor(target[n] * stepsPerMM[n] + 0.5) != floor(position[n] * stepsPerMM[n] + 0.5)) {
+            cmds[n].cmdType = STEPCMD_MOVE_TO;
+            cmds[n].value = target[n];
+            anyMoves = true;
+        }
+        else {
+            cmds[n].cmdType = STEPCMD_PAUSE;
+            cmds[n].value = 0.0;
+        }
+        position[n] = target[n];
+    }
+    if (!anyMoves && !dwell)
+        return(false);
+    for (int n = 0; n < NUM_MOTORS; n++)
+        programs[n].append(cmds[n]);
+    chunkDuration += duration;
+    return(true);
+}
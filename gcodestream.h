@@ -0,0 +1,59 @@
+#ifndef GCODESTREAM_H
+#define GCODESTREAM_H
+
+#include <stddef.h>
+#include <QVector>
+
+#include "stepper.h"
+
+#define GCODE_AXES          "XY"        // Axis letter driving each motor
+#define GCODE_RAPID_FEED    3000.0      // G0 feed rate (mm/min)
+#define GCODE_DEFAULT_FEED  600.0       // G1 feed rate (mm/min) until the file sets one
+#define GCODE_ACCEL         1.0         // Acceleration given to every move
+#define GCODE_MIN_DURATION  0.0001      // Shortest block (sec), anything quicker is stretched
+#define GCODE_CHUNK_SECS    0.5         // Low-water mark, each program handed to the stepper lasts this long (sec)
+#define GCODE_CHUNK_BLOCKS  4096        // Most blocks in one program
+#define GCODE_FEED_POLL_MS  10          // How often to check whether the next program's been swapped in
+#define GCODE_RELEASE_BYTES (4 << 20)   // Give parsed pages back to the kernel every this many bytes
+#define GCODE_MAX_WARNINGS  10          // Unsupported words we complain about before going quiet
+
+// Streaming G-code reader for the G0/G1/G4/G20/G21/G90/G91 subset.
+// The file is mapped and parsed a chunk of blocks at a time straight into stepper
+// programs, pages we're done with are handed back so memory use stays bounded however
+// big the file is.  Every block becomes one command per motor - a "move to" for axes
+// that move and a pause for those that don't - all taking the block's time at its feed
+// rate, so the motors work through the blocks together...
+class gcodeStream {
+private:
+    char fileName[256];         // Our own copy of the path, for the log
+    int fd;
+    const char *data;
+    size_t size;
+    size_t offset;              // Where the next line starts
+    size_t released;            // Everything before this has been given back
+    long int lineNum;
+    bool relative;              // G91
+    double unitScale;           // mm per program unit (G20/G21)
+    double feed;                // G1 feed rate (mm/min)
+    int motionMode;             // Last G0/G1
+    double position[NUM_MOTORS];    // Where each axis will be after the blocks so far (mm)
+    double chunkDuration;       // How long (sec) the blocks of the chunk being parsed take
+    double stepsPerMM[NUM_MOTORS];
+    int numWarnings;
+    //
+    int parseLine(const char *line, const char *end, QVector<stepperProgramCmd> programs[NUM_MOTORS]);
+    bool addBlock(const double target[NUM_MOTORS], double duration, bool dwell, QVector<stepperProgramCmd> programs[NUM_MOTORS]);
+    void warn(const char *what, char letter, double value);
+
+public:
+    gcodeStream();
+    ~gcodeStream();
+    bool open(const char *path, const double startPos[NUM_MOTORS], const double axisStepsPerMM[NUM_MOTORS]);
+    void close();
+    bool isOpen() { return(data != NULL); }
+    bool atEnd() { return(offset >= size); }
+    long int getLineNum() { return(lineNum); }
+    int nextChunk(QVector<stepperProgramCmd> programs[NUM_MOTORS], double minDuration = GCODE_CHUNK_SECS, int maxBlocks = GCODE_CHUNK_BLOCKS);
+};
+
+#endif // GCODESTREAM_H
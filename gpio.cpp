@@ -0,0 +1,203 @@
+/*
+*************************************
+* gpio.cpp:
+*   GPIO output backends for the stepper engine
+*************************************
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "gpio.h"
+#include "rtlog.h"
+
+#ifdef GPIO_CHARDEV
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+#endif
+
+#ifdef GPIO_SIM
+
+// Simulated pins: current levels and a trace of every change.  The step threads all
+// write the trace, so each change claims its slot atomically...
+struct gpioSimEvent {
+    long long int time;
+    int pin;
+    int value;
+};
+
+static int simLevels[GPIO_SIM_MAX_PINS];
+static gpioSimEvent *simTrace;
+static volatile long int simTraceCount;     // Slots claimed, can run past GPIO_SIM_TRACE_SIZE
+
+void gpioInit(void)
+{
+    for (int pin = 0; pin < GPIO_SIM_MAX_PINS; pin++)
+        simLevels[pin] = LOW;
+    simTraceCount = 0;
+    simTrace = NULL;
+    if (getenv("GPIO_SIM_TRACE"))
+        simTrace = new gpioSimEvent[GPIO_SIM_TRACE_SIZE];
+    rtLog(LOG_INFO, "GPIO: simulated%s", simTrace ? ", tracing" : "");
+}
+
+void gpioOutput(int pin, int value)
+{
+    gpioWrite(pin, value);
+}
+
+void gpioWrite(int pin, int value)
+{
+    if (pin < 0 || pin >= GPIO_SIM_MAX_PINS || simLevels[pin] == value)
+        return;
+    simLevels[pin] = value;
+    if (simTrace && simTraceCount < GPIO_SIM_TRACE_SIZE) {
+        long int slot = __sync_fetch_and_add(&simTraceCount, 1);
+        if (slot >= GPIO_SIM_TRACE_SIZE)
+            return;
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        gpioSimEvent *ev = &simTrace[slot];
+        ev->time = (long long int)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+        ev->pin = pin;
+        ev->value = value;
+    }
+}
+
+// Write out the trace, if we kept one (the step threads have stopped by now)...
+void gpioShutdown(void)
+{
+    if (!simTrace)
+        return;
+    if (simTraceCount > GPIO_SIM_TRACE_SIZE)
+        simTraceCount = GPIO_SIM_TRACE_SIZE;
+    const char *path = getenv("GPIO_SIM_TRACE");
+    FILE *fp = fopen(path, "w");
+    if (fp) {
+        for (long int n = 0; n < simTraceCount; n++)
+            fprintf(fp, "%lld %d %d\n", simTrace[n].time, simTrace[n].pin, simTrace[n].value);
+        fclose(fp);
+    }
+    else
+        rtLog(LOG_ERROR, "GPIO: can't write the trace file");
+    if (simTraceCount == GPIO_SIM_TRACE_SIZE)
+        rtLog(LOG_WARN, "GPIO: trace full, later pin changes weren't recorded");
+    delete [] simTrace;
+    simTrace = NULL;
+}
+
+#elif defined(GPIO_CHARDEV)
+
+// BCM line of each wiringPi pin (Pi rev 2 and later)...
+static const int wiringPiToBcm[GPIO_CHARDEV_MAX_PINS] = {
+    17, 18, 27, 22, 23, 24, 25, 4, 2, 3, 8, 7, 10, 9, 11, 14,
+    15, 28, 29, 30, 31, 5, 6, 13, 19, 26, 12, 16, 20, 21, 0, 1
+};
+
+int gpioLineBit[GPIO_CHARDEV_MAX_PINS];
+__thread unsigned long long gpioPendingMask;
+__thread unsigned long long gpioPendingBits;
+static int chipFd = -1;
+static int lineFd = -1;
+static int numLines;
+static int linePins[GPIO_V2_LINES_MAX];     // wiringPi pin of each line in the request
+static unsigned long long initialBits;      // Level each line was set up with
+
+void gpioInit(void)
+{
+    for (int pin = 0; pin < GPIO_CHARDEV_MAX_PINS; pin++)
+        gpioLineBit[pin] = -1;
+    gpioPendingMask = 0;
+    gpioPendingBits = 0;
+    initialBits = 0;
+    numLines = 0;
+    const char *chip = getenv("GPIO_CHIP");
+    if (!chip) chip = GPIO_CHARDEV_CHIP;
+    chipFd = open(chip, O_RDWR | O_CLOEXEC);
+    if (chipFd < 0)
+        rtLog(LOG_ERROR, "GPIO: can't open %s", chip);
+    else
+        rtLog(LOG_INFO, "GPIO: character device %s", chip);
+}
+
+// Add a pin to the outputs (set up time only, before the step threads start).  A line
+// request can't grow, so it's replaced by one for all the pins so far, each starting
+// at the level it was set up with...
+void gpioOutput(int pin, int value)
+{
+    if (chipFd < 0 || pin < 0 || pin >= GPIO_CHARDEV_MAX_PINS)
+        return;
+    if (gpioLineBit[pin] < 0) {
+        if (numLines == GPIO_V2_LINES_MAX)
+            return;
+        linePins[numLines] = pin;
+        gpioLineBit[pin] = numLines++;
+    }
+    if (value) initialBits |= 1ULL << gpioLineBit[pin];
+    else initialBits &= ~(1ULL << gpioLineBit[pin]);
+    struct gpio_v2_line_request req;
+    memset(&req, 0, sizeof(req));
+    for (int l = 0; l < numLines; l++)
+        req.offsets[l] = wiringPiToBcm[linePins[l]];
+    req.num_lines = numLines;
+    strncpy(req.consumer, "robotPanel", sizeof(req.consumer) - 1);
+    req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+    req.config.num_attrs = 1;
+    req.config.attrs[0].attr.id = GPIO_V2_LINE_ATTR_ID_OUTPUT_VALUES;
+    req.config.attrs[0].attr.values = initialBits;
+    req.config.attrs[0].mask = (numLines == 64)?~0ULL:((1ULL << numLines) - 1);
+    if (lineFd >= 0)
+        close(lineFd);
+    lineFd = -1;
+    if (ioctl(chipFd, GPIO_V2_GET_LINE_IOCTL, &req) < 0) {
+        rtLog(LOG_ERROR, "GPIO: can't request %d output lines", numLines);
+        return;
+    }
+    lineFd = req.fd;
+}
+
+// Set every line changed since the last commit at once...
+void gpioCommit(void)
+{
+    if (!gpioPendingMask || lineFd < 0)
+        return;
+    struct gpio_v2_line_values values;
+    values.bits = gpioPendingBits;
+    values.mask = gpioPendingMask;
+    ioctl(lineFd, GPIO_V2_LINE_SET_VALUES_IOCTL, &values);
+    gpioPendingMask = 0;
+}
+
+void gpioShutdown(void)
+{
+    gpioCommit();
+    if (lineFd >= 0)
+        close(lineFd);
+    if (chipFd >= 0)
+        close(chipFd);
+    lineFd = -1;
+    chipFd = -1;
+}
+
+#else
+
+void gpioInit(void)
+{
+    wiringPiSetup();
+}
+
+void gpioOutput(int pin, int value)
+{
+    pinMode(pin, OUTPUT);
+    digitalWrite(pin, value);
+}
+
+void gpioShutdown(void)
+{
+}
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef GPIO_H
+#define GPIO_H
+
+// GPIO output backend used by the stepper engine.
+// Build with DEFINES += GPIO_SIM (qmake CONFIG+=sim_gpio) to run without hardware: pin
+// changes are recorded in memory and written to the file named by $GPIO_SIM_TRACE
+// at shutdown as "time_ns pin value" lines.  Build with DEFINES += GPIO_CHARDEV
+// (CONFIG+=chardev_gpio) to drive the pins through the kernel's GPIO character device
+// instead of wiringPi's /dev/mem mapping - no root needed, and it works against a gpio-sim
+// chip too.  Otherwise wiringPi drives the pins.  Pins are always wiringPi numbers...
+//
+// gpioWrite() may be buffered until the next gpioCommit(), so callers commit after
+// each group of changes that has to reach the pins together...
+
+#define GPIO_SIM_MAX_PINS       64
+#define GPIO_SIM_TRACE_SIZE     (1 << 20)   // Pin changes kept for the trace file
+#define GPIO_CHARDEV_MAX_PINS   32          // wiringPi pins we know the BCM line of
+#define GPIO_CHARDEV_CHIP       "/dev/gpiochip0"    // Unless $GPIO_CHIP says otherwise
+
+#ifdef GPIO_SIM
+
+#define LOW     0
+#define HIGH    1
+
+void gpioWrite(int pin, int value);
+inline void gpioCommit(void) {}
+
+#elif defined(GPIO_CHARDEV)
+
+#define LOW     0
+#define HIGH    1
+
+// Every output line is held in one line request, changes are gathered up as a mask and
+// values and gpioCommit() sets them all with a single GPIO_V2_LINE_SET_VALUES ioctl.
+// Each thread gathers its own changes, so the GUI enabling a motor can't commit (or
+// lose) half of a step thread's pulse...
+extern int gpioLineBit[GPIO_CHARDEV_MAX_PINS];     // Pin's bit in the request, -1 if not requested
+extern __thread unsigned long long gpioPendingMask;
+extern __thread unsigned long long gpioPendingBits;
+
+inline void gpioWrite(int pin, int value)
+{
+    if (pin < 0 || pin >= GPIO_CHARDEV_MAX_PINS || gpioLineBit[pin] < 0)
+        return;
+    unsigned long long bit = 1ULL << gpioLineBit[pin];
+    gpioPendingMask |= bit;
+    if (value) gpioPendingBits |= bit;
+    else gpioPendingBits &= ~bit;
+}
+void gpioCommit(void);
+
+#else
+
+#include <wiringPi.h>
+
+inline void gpioWrite(int pin, int value) { digitalWrite(pin, value); }
+inline void gpioCommit(void) {}
+
+#endif
+
+void gpioInit(void);
+void gpioOutput(int pin, int value);
+void gpioShutdown(void);
+
+#endif // GPIO_H
@@ -0,0 +1,190 @@
+/*
+*************************************
+* ipcclient.cpp:
+*   Client side of the stepper engine's command socket
+*************************************
+*/
+
+#include <string.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ipcclient.h"
+
+ipcClient::ipcClient()
+{
+    fd = -1;
+    seq = 0;
+    lastStatus = IPCERR_OK;
+    batch.hdr.magic = IPC_MAGIC;
+    batch.hdr.type = IPCMSG_BATCH;
+    batch.hdr.count = 0;
+}
+
+ipcClient::~ipcClient()
+{
+    disconnect();
+}
+
+bool ipcClient::connectTo(const char *path)
+{
+    struct sockaddr_un addr;
+    disconnect();
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path))
+        return(false);
+    strcpy(addr.sun_path, path);
+    fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return(false);
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        close(fd);
+        fd = -1;
+        return(false);
+    }
+    return(true);
+}
+
+void ipcClient::disconnect()
+{
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    batch.hdr.count = 0;
+}
+
+// Send one message and wait for the reply with the same sequence number...
+int ipcClient::transact(const void *msg, int len, void *reply, int replyLen)
+{
+    if (fd < 0)
+        return(-1);
+    if (send(fd, msg, len, MSG_NOSIGNAL) != len)
+        return(-1);
+    int rlen = recv(fd, reply, replyLen, 0);
+    if (rlen < (int)sizeof(ipcHeader) || ((ipcHeader *)reply)->magic != IPC_MAGIC)
+        return(-1);
+    return(rlen);
+}
+
+int ipcClient::addCommand(int op, int motor, int iarg, double a0, double a1, double a2)
+{
+    // Make room if the batch is already full...
+    if (batch.hdr.count == IPC_MAX_BATCH && flush() < 0)
+        return(-1);
+    ipcCommand *cmd = &batch.cmds[batch.hdr.count++];
+    cmd->op = op;
+    cmd->motor = motor;
+    cmd->iarg = iarg;
+    cmd->reserved = 0;
+    cmd->args[0] = a0;
+    cmd->args[1] = a1;
+    cmd->args[2] = a2;
+    return(0);
+}
+
+int ipcClient::move(int motorNum, double distance, double duration, double accel)
+{
+    return(addCommand(IPCOP_MOVE, motorNum, 0, distance, duration, accel));
+}
+
+int ipcClient::moveTo(int motorNum, double position, double duration, double accel)
+{
+    return(addCommand(IPCOP_MOVE_TO, motorNum, 0, position, duration, accel));
+}
+
+int ipcClient::pause(int motorNum, double duration)
+{
+    return(addCommand(IPCOP_PAUSE, motorNum, 0, duration, 0.0, 0.0));
+}
+
+int ipcClient::loopStart(int motorNum)
+{
+    return(addCommand(IPCOP_LOOP_START, motorNum, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::loopEnd(int motorNum, int startLoopIndex, int count)
+{
+    return(addCommand(IPCOP_LOOP_END, motorNum, startLoopIndex, count, 0.0, 0.0));
+}
+
+int ipcClient::setPosition(int motorNum, double position)
+{
+    return(addCommand(IPCOP_SET_POSITION, motorNum, 0, position, 0.0, 0.0));
+}
+
+int ipcClient::start(int motorNum)
+{
+    return(addCommand(IPCOP_START, motorNum, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::stop(int motorNum)
+{
+    return(addCommand(IPCOP_STOP, motorNum, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::reset(int motorNum)
+{
+    return(addCommand(IPCOP_RESET, motorNum, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::clear(int motorNum)
+{
+    return(addCommand(IPCOP_CLEAR, motorNum, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::profile(int flags)
+{
+    return(addCommand(IPCOP_PROFILE, -1, flags, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::profileDump()
+{
+    return(addCommand(IPCOP_PROFILE_DUMP, -1, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::hold()
+{
+    return(addCommand(IPCOP_HOLD, -1, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::resume()
+{
+    return(addCommand(IPCOP_RESUME, -1, 0, 0.0, 0.0, 0.0));
+}
+
+int ipcClient::flush()
+{
+    int count = batch.hdr.count;
+    if (count == 0)
+        return(0);
+    batch.hdr.seq = ++seq;
+    ipcAckMsg ack;
+    int len = sizeof(ipcHeader) + count * sizeof(ipcCommand);
+    int rlen = transact(&batch, len, &ack, sizeof(ack));
+    batch.hdr.count = 0;
+    if (rlen < (int)sizeof(ack) || ack.hdr.seq != seq) {
+        lastStatus = IPCERR_BAD_MESSAGE;
+        return(-1);
+    }
+    lastStatus = ack.status;
+    return((ack.status == IPCERR_OK)?ack.numAccepted:-1);
+}
+
+bool ipcClient::getState(machineState *state)
+{
+    ipcHeader req;
+    req.magic = IPC_MAGIC;
+    req.type = IPCMSG_STATUS;
+    req.count = 0;
+    req.seq = ++seq;
+    ipcStateMsg reply;
+    if (transact(&req, sizeof(req), &reply, sizeof(reply)) < (int)sizeof(reply)
+            || reply.hdr.type != IPCMSG_STATE || reply.hdr.seq != seq)
+        return(false);
+    *state = reply.state;
+    return(true);
+}
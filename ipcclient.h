@@ -0,0 +1,48 @@
+#ifndef IPCCLIENT_H
+#define IPCCLIENT_H
+
+#include "ipcprotocol.h"
+
+// Small client for the stepper engine's command socket.
+// Commands are collected into a batch and sent by flush() (or automatically
+// when a command is added to a full batch).  Not thread safe, use one per thread...
+class ipcClient {
+private:
+    int fd;
+    unsigned int seq;
+    ipcBatchMsg batch;
+    int lastStatus;
+    //
+    int addCommand(int op, int motor, int iarg, double a0, double a1, double a2);
+    int transact(const void *msg, int len, void *reply, int replyLen);
+
+public:
+    ipcClient();
+    ~ipcClient();
+    bool connectTo(const char *path = IPC_SOCKET_PATH);
+    void disconnect();
+    bool isConnected() { return(fd >= 0); }
+    // Batched commands (return < 0 if an automatic flush failed)...
+    int move(int motorNum, double distance, double duration, double accel = 1.0);
+    int moveTo(int motorNum, double position, double duration, double accel = 1.0);
+    int pause(int motorNum, double duration);
+    int loopStart(int motorNum);
+    int loopEnd(int motorNum, int startLoopIndex, int count);
+    int setPosition(int motorNum, double position);
+    int start(int motorNum = -1);
+    int stop(int motorNum = -1);
+    int reset(int motorNum = -1);
+    int clear(int motorNum = -1);
+    int profile(int flags);
+    int profileDump();
+    int hold();
+    int resume();
+    int pending() { return(batch.hdr.count); }
+    // Send the batch and wait for the ack, returns the number of commands accepted or < 0...
+    int flush();
+    int getLastStatus() { return(lastStatus); }
+    // Get a machine state snapshot from the engine...
+    bool getState(machineState *state);
+};
+
+#endif // IPCCLIENT_H
@@ -0,0 +1,73 @@
+#ifndef IPCPROTOCOL_H
+#define IPCPROTOCOL_H
+
+// Binary command protocol spoken over the local SOCK_SEQPACKET socket.
+// Every message starts with an ipcHeader, each send is exactly one message.
+// Both ends run on the same machine so structs go over the wire as-is...
+
+#include "machinestate.h"
+
+#define IPC_SOCKET_PATH     "/tmp/robotPanel.sock"
+#define IPC_MAGIC           0x314d4950      // "PIM1"
+#define IPC_MAX_BATCH       256             // Most commands in one batch message
+#define IPC_MAX_CLIENTS     8
+
+// Message types...
+#define IPCMSG_BATCH        1   // Client -> engine: batch of commands
+#define IPCMSG_STATUS       2   // Client -> engine: request a machine state snapshot
+#define IPCMSG_ACK          3   // Engine -> client: batch result
+#define IPCMSG_STATE        4   // Engine -> client: machine state snapshot
+
+// Batch command operations...
+#define IPCOP_MOVE          1   // args: distance (mm), duration (sec), accel
+#define IPCOP_PAUSE         2   // args: duration (sec)
+#define IPCOP_LOOP_START    3
+#define IPCOP_LOOP_END      4   // iarg: queue index of the loop start, args: count (<0 = forever)
+#define IPCOP_START         5   // motor < 0 for all motors
+#define IPCOP_STOP          6   // motor < 0 for all motors
+#define IPCOP_RESET         7   // motor < 0 for all motors
+#define IPCOP_CLEAR         8   // motor < 0 for all motors
+#define IPCOP_MOVE_TO       9   // args: position (mm), duration (sec), accel
+#define IPCOP_SET_POSITION  10  // args: position (mm)
+#define IPCOP_PROFILE       11  // iarg: PROFILE_* switches (stepprofile.h), 0 = off
+#define IPCOP_PROFILE_DUMP  12  // Log the latency histograms and write the trace to PROFILE_TRACE_PATH
+#define IPCOP_HOLD          13  // Feed hold, every motor slows to a stop where it is
+#define IPCOP_RESUME        14  // Carry on after a feed hold
+
+// Ack status codes...
+#define IPCERR_OK           0
+#define IPCERR_BAD_MESSAGE  -1  // Malformed message, nothing was done
+#define IPCERR_REJECTED     -2  // A command failed, numAccepted say how far we got
+
+struct ipcHeader {
+    unsigned int magic;
+    unsigned short type;
+    unsigned short count;       // Number of commands in a batch
+    unsigned int seq;           // Echoed back in the reply
+};
+
+struct ipcCommand {
+    int op;
+    int motor;
+    int iarg;
+    int reserved;
+    double args[3];
+};
+
+struct ipcBatchMsg {
+    ipcHeader hdr;
+    ipcCommand cmds[IPC_MAX_BATCH];
+};
+
+struct ipcAckMsg {
+    ipcHeader hdr;
+    int status;
+    int numAccepted;
+};
+
+struct ipcStateMsg {
+    ipcHeader hdr;
+    machineState state;
+};
+
+#endif // IPCPROTOCOL_H
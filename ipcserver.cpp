@@ -0,0 +1,276 @@
+/*
+*************************************
+* ipcserver.cpp:
+*   Accept batched commands from other processes over
+*   a local SOCK_SEQPACKET socket
+*************************************
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "ipcserver.h"
+#include "stepper.h"
+#include "rtlog.h"
+
+ipcServer::ipcServer(stepper *stepperObj)
+{
+    this->stepperObj = stepperObj;
+    running = false;
+    listenFd = -1;
+    wakePipe[0] = wakePipe[1] = -1;
+    for (int n = 0; n < IPC_MAX_CLIENTS; n++)
+        clientFds[n] = -1;
+    socketPath[0] = 0;
+}
+
+ipcServer::~ipcServer()
+{
+    stop();
+}
+
+// Create the socket and start serving it...
+bool ipcServer::start(const char *path)
+{
+    if (running)
+        return(true);
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        rtLog(LOG_ERROR, "ipcServer: socket path too long");
+        return(false);
+    }
+    strcpy(addr.sun_path, path);
+    strcpy(socketPath, path);
+    // Clear out any socket left behind by a previous run...
+    unlink(path);
+    listenFd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (listenFd < 0) {
+        rtLog(LOG_ERROR, "ipcServer: socket: %s", strerror(errno));
+        return(false);
+    }
+    if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listenFd, IPC_MAX_CLIENTS) < 0) {
+        rtLog(LOG_ERROR, "ipcServer: bind/listen: %s", strerror(errno));
+        close(listenFd);
+        listenFd = -1;
+        return(false);
+    }
+    if (pipe(wakePipe) < 0) {
+        rtLog(LOG_ERROR, "ipcServer: pipe: %s", strerror(errno));
+        close(listenFd);
+        listenFd = -1;
+        return(false);
+    }
+    // We're not real-time, don't inherit the GUI's scheduling...
+    pthread_attr_t attr;
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    running = true;
+    int iReturnValue = pthread_create(&sThread, &attr, &serverThread1, (void *)this);
+    pthread_attr_destroy(&attr);
+    if (iReturnValue) {
+        rtLog(LOG_ERROR, "Unable to start ipcServer thread?");
+        running = false;
+        stop();
+        return(false);
+    }
+    return(true);
+}
+
+// Stop serving and close everything down...
+void ipcServer::stop()
+{
+    if (running) {
+        running = false;
+        if (write(wakePipe[1], "x", 1) < 0)
+            rtLog(LOG_ERROR, "ipcServer: wake: %s", strerror(errno));
+        pthread_join(sThread, NULL);
+    }
+    for (int n = 0; n < IPC_MAX_CLIENTS; n++) {
+        if (clientFds[n] >= 0) close(clientFds[n]);
+        clientFds[n] = -1;
+    }
+    if (listenFd >= 0) {
+        close(listenFd);
+        unlink(socketPath);
+    }
+    listenFd = -1;
+    for (int n = 0; n < 2; n++) {
+        if (wakePipe[n] >= 0) close(wakePipe[n]);
+        wakePipe[n] = -1;
+    }
+}
+
+void *ipcServer::serverThread1(void *p_this)
+{
+    ((ipcServer *)p_this)->serverThread();
+    return(NULL);
+}
+
+// Wait for connections and messages until we're stopped...
+void ipcServer::serverThread()
+{
+    struct pollfd fds[IPC_MAX_CLIENTS + 2];
+    while (running) {
+        fds[0].fd = wakePipe[0];
+        fds[0].events = POLLIN;
+        fds[1].fd = listenFd;
+        fds[1].events = POLLIN;
+        for (int n = 0; n < IPC_MAX_CLIENTS; n++) {
+            fds[n + 2].fd = clientFds[n];
+            fds[n + 2].events = POLLIN;
+        }
+        if (poll(fds, IPC_MAX_CLIENTS + 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            rtLog(LOG_ERROR, "ipcServer: poll: %s", strerror(errno));
+            break;
+        }
+        if (fds[0].revents)
+            break;
+        // New client...
+        if (fds[1].revents & POLLIN) {
+            int fd = accept4(listenFd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd >= 0) {
+                int n;
+                for (n = 0; n < IPC_MAX_CLIENTS && clientFds[n] >= 0; n++)
+                    ;
+                if (n < IPC_MAX_CLIENTS)
+                    clientFds[n] = fd;
+                else
+                    close(fd);
+            }
+        }
+        // Messages from existing clients...
+        for (int n = 0; n < IPC_MAX_CLIENTS; n++) {
+            if (clientFds[n] < 0 || !fds[n + 2].revents)
+                continue;
+            int len = recv(clientFds[n], &msgBuf, sizeof(msgBuf), 0);
+            if (len <= 0) {
+                close(clientFds[n]);
+                clientFds[n] = -1;
+                continue;
+            }
+            handleMessage(clientFds[n], len);
+        }
+    }
+}
+
+// Carry out one message and send the reply...
+void ipcServer::handleMessage(int fd, int len)
+{
+    ipcHeader *hdr = &msgBuf.hdr;
+    if (len < (int)sizeof(ipcHeader) || hdr->magic != IPC_MAGIC) {
+        ipcAckMsg ack;
+        ack.hdr.magic = IPC_MAGIC;
+        ack.hdr.type = IPCMSG_ACK;
+        ack.hdr.count = 0;
+        ack.hdr.seq = (len >= (int)sizeof(ipcHeader))?hdr->seq:0;
+        ack.status = IPCERR_BAD_MESSAGE;
+        ack.numAccepted = 0;
+        send(fd, &ack, sizeof(ack), MSG_NOSIGNAL);
+        return;
+    }
+    if (hdr->type == IPCMSG_STATUS) {
+        ipcStateMsg reply;
+        reply.hdr.magic = IPC_MAGIC;
+        reply.hdr.type = IPCMSG_STATE;
+        reply.hdr.count = 0;
+        reply.hdr.seq = hdr->seq;
+        stepperObj->getMachineState(&reply.state);
+        send(fd, &reply, sizeof(reply), MSG_NOSIGNAL);
+        return;
+    }
+    ipcAckMsg ack;
+    ack.hdr.magic = IPC_MAGIC;
+    ack.hdr.type = IPCMSG_ACK;
+    ack.hdr.count = 0;
+    ack.hdr.seq = hdr->seq;
+    ack.status = IPCERR_OK;
+    ack.numAccepted = 0;
+    int count = hdr->count;
+    if (hdr->type != IPCMSG_BATCH || count > IPC_MAX_BATCH
+            || len < (int)(sizeof(ipcHeader) + count * sizeof(ipcCommand))) {
+        ack.status = IPCERR_BAD_MESSAGE;
+    }
+    else {
+        // Run the batch in order, stopping at the first command that fails...
+        for (int c = 0; c < count; c++) {
+            if (runCommand(&msgBuf.cmds[c]) < 0) {
+                ack.status = IPCERR_REJECTED;
+                break;
+            }
+            ack.numAccepted++;
+        }
+    }
+    send(fd, &ack, sizeof(ack), MSG_NOSIGNAL);
+}
+
+// Hand one command to the stepper engine, returns < 0 if it was refused.
+// The queue calls check their arguments (loop ends have to jump back to a loop start
+// that's queued, moves have to take a step), so a client can't upset the step thread...
+int ipcServer::runCommand(const ipcCommand *cmd)
+{
+    bool allMotors = (cmd->motor < 0);
+    if (!allMotors && cmd->motor >= NUM_MOTORS)
+        return(-1);
+    switch (cmd->op) {
+    case IPCOP_MOVE:
+        return(stepperObj->queueMoveCmd(cmd->motor, cmd->args[0], cmd->args[1], cmd->args[2]));
+    case IPCOP_PAUSE:
+        return(stepperObj->queuePauseCmd(cmd->motor, cmd->args[0]));
+    case IPCOP_LOOP_START:
+        if (allMotors) return(-1);
+        stepperObj->queueLoopStartCmd(cmd->motor);
+        return(0);
+    case IPCOP_LOOP_END:
+        if (allMotors) return(-1);
+        return(stepperObj->queueLoopEndCmd(cmd->motor, cmd->iarg, (int)cmd->args[0]));
+    case IPCOP_MOVE_TO:
+        return(stepperObj->queueMoveToCmd(cmd->motor, cmd->args[0], cmd->args[1], cmd->args[2]));
+    case IPCOP_SET_POSITION:
+        return(stepperObj->setPosition(cmd->motor, cmd->args[0]));
+    case IPCOP_START:
+        if (allMotors) stepperObj->startAll();
+        else stepperObj->startMotor(cmd->motor);
+        return(0);
+    case IPCOP_STOP:
+        if (allMotors) stepperObj->stopAll();
+        else stepperObj->stopMotor(cmd->motor);
+        return(0);
+    case IPCOP_RESET:
+        if (allMotors) stepperObj->resetAll();
+        else stepperObj->resetMotor(cmd->motor);
+        return(0);
+    case IPCOP_CLEAR:
+        if (allMotors) stepperObj->clearAll();
+        else stepperObj->clearMotor(cmd->motor);
+        return(0);
+    case IPCOP_PROFILE:
+        stepperObj->setProfiling(cmd->iarg);
+        return(0);
+    case IPCOP_PROFILE_DUMP:
+        stepperObj->logProfile();
+        return((stepperObj->writeProfileTrace() < 0)?-1:0);
+    case IPCOP_HOLD:
+        stepperObj->feedHold();
+        return(0);
+    case IPCOP_RESUME:
+        stepperObj->feedResume();
+        return(0);
+    }
+    return(-1);
+}
@@ -0,0 +1,34 @@
+#ifndef IPCSERVER_H
+#define IPCSERVER_H
+
+#include <pthread.h>
+
+#include "ipcprotocol.h"
+
+class stepper;
+
+// Local command server that lets other processes drive the stepper engine...
+class ipcServer {
+private:
+    stepper *stepperObj;
+    pthread_t sThread;
+    bool running;
+    int listenFd;
+    int wakePipe[2];            // Written to by stop() to break out of poll()
+    int clientFds[IPC_MAX_CLIENTS];
+    char socketPath[108];
+    ipcBatchMsg msgBuf;
+    //
+    static void *serverThread1(void *);
+    void serverThread();
+    void handleMessage(int fd, int len);
+    int runCommand(const ipcCommand *cmd);
+
+public:
+    ipcServer(stepper *stepperObj);
+    ~ipcServer();
+    bool start(const char *path = IPC_SOCKET_PATH);
+    void stop();
+};
+
+#endif // IPCSERVER_H
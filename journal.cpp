@@ -0,0 +1,308 @@
+/*
+*************************************
+* journal.cpp:
+*   Checkpoint how far the motors have got
+*   so a run can pick up where it left off
+*************************************
+*/
+
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+#include "rtlog.h"
+
+#define JOURNAL_PROGRAM_MAGIC   0x3150524a  // "JRP1"
+
+// Header of a saved program file, the commands follow...
+struct journalProgramHeader {
+    unsigned int magic;
+    int numCmds;
+    unsigned long long hash;
+};
+
+progressJournal::progressJournal()
+{
+    fd = -1;
+    file = NULL;
+    live = NULL;
+    fileSize = 0;
+    numGroups = 0;
+    path[0] = 0;
+    runId = 0;
+    haveRecovered = false;
+    syncStatus = 1;
+    for (int g = 0; g < NUM_MOTORS; g++)
+        seq[g] = 0;
+}
+
+progressJournal::~progressJournal()
+{
+    close();
+}
+
+// Map the journal, picking up whatever checkpoint the last run left in it.
+// Has to be opened after mlockall() so the step threads' copy is locked in too...
+bool progressJournal::open(int axisGroups, const char *journalPath)
+{
+    close();
+    if (axisGroups < 1 || axisGroups > NUM_MOTORS)
+        return(false);
+    snprintf(path, sizeof(path), "%s", journalPath);
+    numGroups = axisGroups;
+    fileSize = sizeof(journalFile) + (numGroups * 2 - 2) * sizeof(journalSlot);
+    fd = ::open(path, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        rtLog(LOG_WARN, "Can't open journal %s, runs can't be resumed", path);
+        return(false);
+    }
+    struct stat st;
+    bool fresh = (fstat(fd, &st) < 0 || st.st_size != (off_t)fileSize);
+    if (fresh && ftruncate(fd, fileSize) < 0) {
+        rtLog(LOG_WARN, "Can't size journal %s", path);
+        close();
+        return(false);
+    }
+    void *map = mmap(NULL, fileSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        rtLog(LOG_WARN, "Can't map journal %s", path);
+        map = NULL;
+        close();
+        return(false);
+    }
+    file = (journalFile *)map;
+    if (fresh || file->magic != JOURNAL_MAGIC || file->version != JOURNAL_VERSION || file->numGroups != numGroups
+            || file->numMotors != NUM_MOTORS || file->slotSize != (int)sizeof(journalSlot)) {
+        memset(file, 0, fileSize);
+        file->magic = JOURNAL_MAGIC;
+        file->version = JOURNAL_VERSION;
+        file->numGroups = numGroups;
+        file->numMotors = NUM_MOTORS;
+        file->slotSize = sizeof(journalSlot);
+        file->noRun = 1;
+        msync(file, fileSize, MS_SYNC);
+    }
+    else
+        readCheckpoint();
+    // The step threads start from what's in the file (touching every page of their copy)...
+    live = (journalFile *)new char[fileSize];
+    memcpy(live, file, fileSize);
+    // Carry on numbering from the last run so its checkpoints always look older...
+    runId = (long long int)time(NULL);
+    for (int g = 0; g < numGroups; g++) {
+        seq[g] = 0;
+        for (int w = 0; w < 2; w++)
+            if (slotValid(slot(file, g, w)) && slot(file, g, w)->seq > seq[g])
+                seq[g] = slot(file, g, w)->seq;
+    }
+    syncStatus = 0;
+    if (pthread_create(&syncThread, NULL, &syncThread1, (void *)this)) {
+        rtLog(LOG_WARN, "Unable to start the journal sync thread");
+        syncStatus = 1;
+    }
+    return(true);
+}
+
+void progressJournal::close()
+{
+    if (!syncStatus) {
+        syncStatus = 1;
+        pthread_join(syncThread, NULL);
+    }
+    if (file) {
+        if (live)
+            syncCheckpoints();
+        munmap(file, fileSize);
+    }
+    if (fd >= 0)
+        ::close(fd);
+    delete [] (char *)live;
+    fd = -1;
+    file = NULL;
+    live = NULL;
+}
+
+// FNV-1a over a slot, less the checksum itself...
+unsigned int progressJournal::checksum(const journalSlot *s)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    unsigned int hash = 2166136261u;
+    for (size_t b = 0; b < offsetof(journalSlot, checksum); b++) {
+        hash ^= p[b];
+        hash *= 16777619u;
+    }
+    return(hash);
+}
+
+bool progressJournal::slotValid(const journalSlot *s)
+{
+    return(s->seq != 0 && s->checksum == checksum(s));
+}
+
+// Work out where the last run got to.  Each group's newest whole checkpoint, except
+// that groups checkpoint on the same cycles so if one got a checkpoint further than
+// another before we died it's dropped back to the one they both have.  Nothing if the
+// last run was stopped on purpose or we shut down cleanly...
+void progressJournal::readCheckpoint()
+{
+    const journalSlot *best[NUM_MOTORS];
+    long long int oldest = -1;
+    haveRecovered = false;
+    if (file->noRun)
+        return;
+    for (int g = 0; g < numGroups; g++) {
+        best[g] = NULL;
+        for (int w = 0; w < 2; w++) {
+            const journalSlot *s = slot(file, g, w);
+            if (slotValid(s) && (!best[g] || s->seq > best[g]->seq))
+                best[g] = s;
+        }
+        if (!best[g])
+            return;
+        if (oldest < 0 || best[g]->cycle < oldest)
+            oldest = best[g]->cycle;
+    }
+    for (int g = 0; g < numGroups; g++) {
+        const journalSlot *other = slot(file, g, (best[g] == slot(file, g, 0))?1:0);
+        if (best[g]->cycle > oldest && slotValid(other) && other->runId == best[g]->runId && other->cycle == oldest)
+            best[g] = other;
+    }
+    memset(recovered, 0, sizeof(recovered));
+    for (int g = 0; g < numGroups; g++) {
+        for (int n = 0; n < NUM_MOTORS; n++)
+            if (best[g]->motorMask & (1 << n))
+                recovered[n] = best[g]->motor[n];
+    }
+    haveRecovered = true;
+}
+
+// The last run's checkpoint, false if there isn't one...
+bool progressJournal::recover(journalMotor motors[NUM_MOTORS])
+{
+    if (!haveRecovered)
+        return(false);
+    for (int n = 0; n < NUM_MOTORS; n++)
+        motors[n] = recovered[n];
+    return(true);
+}
+
+// The motors have been started, from here on if we die there's a run to pick up.
+// Checkpoints left from before only describe where it started from...
+void progressJournal::runStarted()
+{
+    if (file)
+        file->noRun = 0;
+}
+
+// The run's been stopped on purpose (reset, cleared or we're shutting down),
+// don't offer to pick it up next time...
+void progressJournal::invalidate()
+{
+    haveRecovered = false;
+    if (!file)
+        return;
+    file->noRun = 1;
+    msync(file, fileSize, MS_SYNC);
+}
+
+// Static(!?) method used to start the sync thread...
+void *progressJournal::syncThread1(void *p_journal)
+{
+    ((progressJournal *)p_journal)->syncLoop();
+    return(NULL);
+}
+
+// Push the step threads' checkpoints out to disk every so often, so they survive
+// losing the machine as well as losing the process...
+void progressJournal::syncLoop()
+{
+    struct timespec delay = {0, JOURNAL_SYNC_MS * 1000000L};
+    while (!syncStatus) {
+        nanosleep(&delay, NULL);
+        syncCheckpoints();
+    }
+}
+
+// Copy each group's newest whole checkpoint from the step threads' copy into the file
+// and flush it.  A slot caught half written won't match its checksum and waits for next
+// time.  Only one slot per group is written each time, the one the newer checkpoint
+// replaces, so the file's other slot stays good whatever happens to the write...
+void progressJournal::syncCheckpoints()
+{
+    for (int g = 0; g < numGroups; g++) {
+        journalSlot newest, copy;
+        newest.seq = 0;
+        for (int w = 0; w < 2; w++) {
+            memcpy(&copy, slot(live, g, w), sizeof(copy));
+            if (slotValid(&copy) && copy.seq > newest.seq)
+                newest = copy;
+        }
+        journalSlot *dest = slot(file, g, newest.seq & 1);
+        if (newest.seq != 0 && dest->seq != newest.seq)
+            *dest = newest;
+    }
+    msync(file, fileSize, MS_SYNC);
+}
+
+void progressJournal::programPath(int motorNum, char *buf, int bufLen)
+{
+    snprintf(buf, bufLen, "%s.prog%d", path, motorNum);
+}
+
+// Keep a copy of a motor's program beside the journal so it can be run again
+// after a restart.  Written to the side and renamed so there's always a whole one...
+bool progressJournal::saveProgram(int motorNum, unsigned long long hash, const stepperProgramCmd *cmds, int numCmds)
+{
+    if (!file || motorNum < 0 || motorNum >= NUM_MOTORS || numCmds < 0)
+        return(false);
+    char progPath[300], tmpPath[310];
+    programPath(motorNum, progPath, sizeof(progPath));
+    snprintf(tmpPath, sizeof(tmpPath), "%s.tmp", progPath);
+    FILE *fp = fopen(tmpPath, "wb");
+    if (!fp) {
+        rtLog(LOG_WARN, "Can't save motor %d's program beside journal %s", motorNum + 1, path);
+        return(false);
+    }
+    journalProgramHeader hdr;
+    hdr.magic = JOURNAL_PROGRAM_MAGIC;
+    hdr.numCmds = numCmds;
+    hdr.hash = hash;
+    bool ok = (fwrite(&hdr, sizeof(hdr), 1, fp) == 1)
+            && (numCmds == 0 || fwrite(cmds, sizeof(stepperProgramCmd), numCmds, fp) == (size_t)numCmds)
+            && fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0)
+        ok = false;
+    if (!ok || rename(tmpPath, progPath) < 0) {
+        rtLog(LOG_WARN, "Can't save motor %d's program beside journal %s", motorNum + 1, path);
+        unlink(tmpPath);
+        return(false);
+    }
+    return(true);
+}
+
+// Read back a program saveProgram() kept, as long as it's the one we want...
+bool progressJournal::readProgram(int motorNum, unsigned long long hash, QVector<stepperProgramCmd> &program)
+{
+    if (motorNum < 0 || motorNum >= NUM_MOTORS)
+        return(false);
+    char progPath[300];
+    programPath(motorNum, progPath, sizeof(progPath));
+    FILE *fp = fopen(progPath, "rb");
+    if (!fp)
+        return(false);
+    journalProgramHeader hdr;
+    bool ok = (fread(&hdr, sizeof(hdr), 1, fp) == 1 && hdr.magic == JOURNAL_PROGRAM_MAGIC
+               && hdr.hash == hash && hdr.numCmds >= 0);
+    if (ok) {
+        program.resize(hdr.numCmds);
+        ok = (hdr.numCmds == 0 || fread(program.data(), sizeof(stepperProgramCmd), hdr.numCmds, fp) == (size_t)hdr.numCmds);
+    }
+    fclose(fp);
+    return(ok);
+}
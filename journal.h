@@ -0,0 +1,118 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#define JOURNAL_PATH        "/var/tmp/robotPanel.journal"
+#define JOURNAL_MAGIC       0x314c4e4a      // "JNL1"
+#define JOURNAL_VERSION     2
+#define JOURNAL_INTERVAL_MS 10      // Default time between checkpoints
+#define JOURNAL_SYNC_MS     250     // How often the sync thread flushes the journal to disk
+#define JOURNAL_MAX_LOOPS   8       // Deepest nesting of loops a checkpoint can record
+
+#include <pthread.h>
+#include <QVector>
+
+#include "machinestate.h"
+#include "stepplan.h"
+
+// One motor's progress through its program...
+struct journalMotor {
+    unsigned long long programHash;     // Program the queue holds, 0 if it isn't a saved program
+    long long int position;             // Absolute position (steps)
+    int currQueuedCmd;
+    int numQueuedCmds;
+    int moveDir;                        // A move under way: which way,
+    long int moveTriggers;              //   its fine steps in all
+    long int moveLeft;                  //   and how many it has left (0 if no move's under way)
+    int numLoops;                       // Loops we're inside, outermost first (-1 if too deep to record)
+    int loopCmd[JOURNAL_MAX_LOOPS];     // Index of each one's loop end
+    long int loopCounter[JOURNAL_MAX_LOOPS];    // and its trigger counter
+};
+
+// A checkpoint of an axis group's motors...
+struct journalSlot {
+    unsigned long long seq;             // Newer checkpoints have bigger numbers
+    long long int runId;                // Which run of the engine wrote it
+    long long int cycle;                // Step thread cycle (from the common epoch) it was taken on
+    unsigned int motorMask;             // Motors (bits) in this checkpoint
+    journalMotor motor[NUM_MOTORS];
+    unsigned int checksum;              // Over everything above, a torn write won't match
+};
+
+// The journal file, two slots per axis group written alternately
+// so there's always one whole checkpoint whatever happens half way through the other...
+struct journalFile {
+    unsigned int magic;
+    int version;
+    int numGroups;
+    int numMotors;
+    int slotSize;
+    int noRun;                          // Set while there's no run to pick up (reset, cleared or shut down)
+    journalSlot slots[1][2];            // Really [numGroups][2]
+};
+
+// Crash safe record of how far the motors have got through their programs.
+// The step threads write checkpoints into a private copy of the journal in locked
+// memory, so no syscalls and no page faults.  They can't write the file's mapping
+// directly, every msync() write protects the pages it cleans so the next checkpoint
+// would fault.  A background thread copies the newest whole checkpoints into the
+// mapping and msync()s it now and then.  If we die the last good checkpoint is still
+// there for recover() next time, along with the programs saveProgram() kept...
+class progressJournal {
+private:
+    int fd;
+    journalFile *file;                      // The file's mapping
+    journalFile *live;                      // What the step threads write (new[], locked)
+    size_t fileSize;
+    int numGroups;
+    char path[256];
+    long long int runId;
+    unsigned long long seq[NUM_MOTORS];     // Last checkpoint written, per group
+    bool haveRecovered;
+    journalMotor recovered[NUM_MOTORS];     // Where the last run got to
+    pthread_t syncThread;
+    volatile int syncStatus;                // Non zero tells the sync thread to finish up
+    //
+    journalSlot *slot(journalFile *f, int groupNum, int which) { return(&f->slots[0][0] + groupNum * 2 + which); }
+    static unsigned int checksum(const journalSlot *s);
+    bool slotValid(const journalSlot *s);
+    void readCheckpoint();
+    static void *syncThread1(void *);
+    void syncLoop();
+    void syncCheckpoints();
+    void programPath(int motorNum, char *buf, int bufLen);
+
+public:
+    progressJournal();
+    ~progressJournal();
+    bool open(int axisGroups, const char *journalPath = JOURNAL_PATH);
+    void close();
+    bool isOpen() { return(file != NULL); }
+    // Step thread side: fill in the group's next slot, then commit it...
+    inline journalSlot *beginCheckpoint(int groupNum);
+    inline void commitCheckpoint(int groupNum);
+    // Last run's checkpoint and programs...
+    bool recover(journalMotor motors[NUM_MOTORS]);
+    void forget() { haveRecovered = false; }
+    // Whether there's a run worth picking up if we die...
+    void runStarted();
+    void invalidate();
+    bool saveProgram(int motorNum, unsigned long long hash, const stepperProgramCmd *cmds, int numCmds);
+    bool readProgram(int motorNum, unsigned long long hash, QVector<stepperProgramCmd> &program);
+};
+
+// The slot after the last one written...
+inline journalSlot *progressJournal::beginCheckpoint(int groupNum)
+{
+    return(slot(live, groupNum, (seq[groupNum] + 1) & 1));
+}
+
+// Seal the slot, a checkpoint only counts once its checksum matches...
+inline void progressJournal::commitCheckpoint(int groupNum)
+{
+    journalSlot *s = slot(live, groupNum, (seq[groupNum] + 1) & 1);
+    s->seq = ++seq[groupNum];
+    s->runId = runId;
+    s->checksum = checksum(s);
+}
+
+#endif // JOURNAL_H
@@ -0,0 +1,33 @@
+#ifndef MACHINESTATE_H
+#define MACHINESTATE_H
+
+// Kept free of Qt so that IPC clients can share it with the stepper engine...
+
+#define NUM_MOTORS 2
+#define NUM_AXIS_GROUPS 1       // Step threads, motors are assigned to them in pi_stepper_pins.h
+
+// Where a motor is with a feed hold...
+#define HOLD_NONE       0   // Running normally
+#define HOLD_SLOWING    1   // Slowing down to a stop part way through a move
+#define HOLD_STOPPED    2   // Stopped, waiting for the hold to be released
+
+// Per motor part of the machine state snapshot...
+struct motorState {
+    long long int position;     // Absolute position (steps)
+    double positionMM;          // Absolute position (mm)
+    double velocity;            // Current step rate (steps/sec, signed)
+    int currQueuedCmd;          // Index of the command being executed
+    int numQueuedCmds;          // Number of commands queued
+    double stepInterval;        // Cycles per fine step of the current move, whatever the step size (0 if not moving)
+    int dir;                    // Direction of the current move (+1/-1)
+    bool stepping;              // Processing its command queue?
+    int hold;                   // HOLD_*
+};
+
+// Consistent snapshot of everything the step thread is doing...
+struct machineState {
+    long long int time;         // System time of the snapshot (uS)
+    motorState motor[NUM_MOTORS];
+};
+
+#endif // MACHINESTATE_H
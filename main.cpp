@@ -1,11 +1,19 @@
 #include <QApplication>
 #include "mainwindow.h"
+#include "rtlog.h"
 
 int main(int argc, char *argv[])
 {
-    QApplication a(argc, argv);
-    MainWindow w;
-    w.show();
-    
-    return a.exec();
+    // Start logging before anything else so nothing gets lost...
+    rtLogStart();
+    int status;
+    {
+        QApplication a(argc, argv);
+        MainWindow w;
+        w.show();
+
+        status = a.exec();
+    }
+    rtLogStop();
+    return status;
 }
@@ -1,120 +1,239 @@
+#include <QFileDialog>
+#include <QMessageBox>
+
 #include "mainwindow.h"
 #include "ui_mainwindow.h"
-#include <iostream>
 #include "stepper.h"
+#include "rtlog.h"
 
 MainWindow::MainWindow(QWidget *parent) :
     QMainWindow(parent),
-    ui(new Ui::MainWindow)
+    ui(new Ui::MainWindow),
+    cmdServer(&stepperObj)
 {
     ui->setupUi(this);
     for (int i = 0; i < NUM_MOTORS; i++) {
         stepperLoops[i] = 0;
+        programDirty[i] = true;
     }
-    std::cout << "Done setup\n";
+    // Only re-read a motion queue when it's been edited...
+    watchMotionQueue(ui->step1_motionQueue, SLOT(step1_programChanged()));
+    watchMotionQueue(ui->step2_motionQueue, SLOT(step2_programChanged()));
+    ui->motionPlot->setSource(&stepperObj);
+    // Keep the info panel up to date with where the motors are...
+    connect(&statusTimer, SIGNAL(timeout()), this, SLOT(updateStatus()));
+    statusTimer.start(100);
+    // Keep a running G-code file topped up...
+    connect(&gcodeTimer, SIGNAL(timeout()), this, SLOT(feedGcode()));
+    // Let other processes queue commands too...
+    cmdServer.start();
+    // Once we're up, see if there's an interrupted run to pick up...
+    if (stepperObj.canResume())
+        QTimer::singleShot(0, this, SLOT(offerResume()));
+    rtLog(LOG_INFO, "Done setup");
 }
 
 MainWindow::~MainWindow()
 {
-    std::cout << "Close up shop!\n";
+    rtLog(LOG_INFO, "Close up shop!");
     delete ui;
 }
 
-void MainWindow::on_step_execute_clicked()
+// Call slot whenever anything in a motion queue list changes...
+void MainWindow::watchMotionQueue(QListWidget *motionQueue, const char *slot)
+{
+    QAbstractItemModel *model = motionQueue->model();
+    connect(model, SIGNAL(rowsInserted(QModelIndex,int,int)), this, slot);
+    connect(model, SIGNAL(rowsRemoved(QModelIndex,int,int)), this, slot);
+    connect(model, SIGNAL(rowsMoved(QModelIndex,int,int,QModelIndex,int)), this, slot);
+    connect(model, SIGNAL(dataChanged(QModelIndex,QModelIndex)), this, slot);
+    connect(model, SIGNAL(modelReset()), this, slot);
+}
+
+void MainWindow::step1_programChanged()
+{
+    programDirty[0] = true;
+}
+
+void MainWindow::step2_programChanged()
+{
+    programDirty[1] = true;
+}
+
+// Turn the text in a motion queue list into a program for the stepper...
+void MainWindow::parseMotionQueue(QListWidget *motionQueue, QVector<stepperProgramCmd> &program)
 {
     QList<int> loopStartIndex;
-    // Clear all currently queued commands...
-    stepperObj.clearAll();
-    // (Re)queue all the commands in the stepper1 list...
-    const char *currCmd;
-    for (int i = 0; i < ui->step1_motionQueue->count(); i++) {
-        // Queue a "move" command...
-        if (ui->step1_motionQueue->item(i)->text().startsWith("move")) {
-            currCmd = qPrintable(ui->step1_motionQueue->item(i)->text());
-            double distance, duration;
-            char str[100];
-            sscanf(currCmd, "%s %lf %lf", str, &distance, &duration);
-            std::cout << "Moving " << distance << " over " << duration << "\n";
-            stepperObj.queueMoveCmd(0, distance, duration, 1.0);
+    program.clear();
+    program.reserve(motionQueue->count());
+    for (int i = 0; i < motionQueue->count(); i++) {
+        QByteArray text = motionQueue->item(i)->text().toLatin1();
+        const char *currCmd = text.constData();
+        char str[100];
+        stepperProgramCmd cmd;
+        cmd.value = 0.0;
+        cmd.duration = 0.0;
+        cmd.accel = 1.0;
+        cmd.loopStart = 0;
+        // A "move" command...
+        if (text.startsWith("move")) {
+            cmd.cmdType = STEPCMD_MOVE;
+            sscanf(currCmd, "%s %lf %lf", str, &cmd.value, &cmd.duration);
         }
-        else if (ui->step1_motionQueue->item(i)->text().startsWith("pause")) {
-            currCmd = qPrintable(ui->step1_motionQueue->item(i)->text());
-            double duration;
-            char str[100];
-            sscanf(currCmd, "%s %lf", str, &duration);
-            std::cout << "Pausing for " << duration << "\n";
-            stepperObj.queuePauseCmd(0, duration);
+        // A "pause" command...
+        else if (text.startsWith("pause")) {
+            cmd.cmdType = STEPCMD_PAUSE;
+            sscanf(currCmd, "%s %lf", str, &cmd.duration);
         }
-        // Queue a "loop" command...
-        else if (ui->step1_motionQueue->item(i)->text().startsWith("loop")) {
-            currCmd = qPrintable(ui->step1_motionQueue->item(i)->text());
-            int loopNum, numIters;
-            char str[100];
-            sscanf(currCmd, "%s %d %d", str, &loopNum, &numIters);
-            std::cout << "Loop start command = " << i << "\n";
-            loopStartIndex << i;
-            stepperObj.queueLoopStartCmd(0);
+        // A "loop" command...
+        else if (text.startsWith("loop")) {
+            cmd.cmdType = STEPCMD_LOOP_START;
+            loopStartIndex << program.size();
         }
-        // Queue an "endloop" command...
-        else if (ui->step1_motionQueue->item(i)->text().startsWith("endloop")) {
-            currCmd = qPrintable(ui->step1_motionQueue->item(i)->text());
+        // An "endloop" command...
+        else if (text.startsWith("endloop")) {
             int loopNum, numIters;
-            char str[100];
             sscanf(currCmd, "%s %d %d", str, &loopNum, &numIters);
-            int startCmd = loopStartIndex.takeLast();
-            std::cout << "Loopend starting cmd = " << startCmd << "\n";
-            stepperObj.queueLoopEndCmd(0, startCmd, numIters);
+            cmd.cmdType = STEPCMD_LOOP_STOP;
+            cmd.value = numIters;
+            cmd.loopStart = loopStartIndex.takeLast();
         }
+        else
+            continue;
+        program.append(cmd);
     }
+}
 
-    // (Re)queue all the commands in the stepper2 list...
-    for (int i = 0; i < ui->step2_motionQueue->count(); i++) {
-        // Queue a "move" command...
-        if (ui->step2_motionQueue->item(i)->text().startsWith("move")) {
-            currCmd = qPrintable(ui->step2_motionQueue->item(i)->text());
-            double distance, duration;
-            char str[100];
-            sscanf(currCmd, "%s %lf %lf", str, &distance, &duration);
-            std::cout << "Moving " << distance << " over " << duration << "\n";
-            stepperObj.queueMoveCmd(1, distance, duration, 1.0);
-        }
-        else if (ui->step2_motionQueue->item(i)->text().startsWith("pause")) {
-            currCmd = qPrintable(ui->step2_motionQueue->item(i)->text());
-            double duration;
-            char str[100];
-            sscanf(currCmd, "%s %lf", str, &duration);
-            std::cout << "Pausing for " << duration << "\n";
-            stepperObj.queuePauseCmd(1, duration);
-        }
-        // Queue a "loop" command...
-        else if (ui->step2_motionQueue->item(i)->text().startsWith("loop")) {
-            currCmd = qPrintable(ui->step2_motionQueue->item(i)->text());
-            int loopNum, numIters;
-            char str[100];
-            sscanf(currCmd, "%s %d %d", str, &loopNum, &numIters);
-            std::cout << "Loop start command = " << i << "\n";
-            loopStartIndex << i;
-            stepperObj.queueLoopStartCmd(1);
+void MainWindow::on_step_execute_clicked()
+{
+    stopGcode();
+    // Re-read any motion queue that's changed since last time...
+    QListWidget *motionQueues[NUM_MOTORS] = {ui->step1_motionQueue, ui->step2_motionQueue};
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (programDirty[n]) {
+            parseMotionQueue(motionQueues[n], programs[n]);
+            programDirty[n] = false;
         }
-        // Queue an "endloop" command...
-        else if (ui->step2_motionQueue->item(i)->text().startsWith("endloop")) {
-            currCmd = qPrintable(ui->step2_motionQueue->item(i)->text());
-            int loopNum, numIters;
-            char str[100];
-            sscanf(currCmd, "%s %d %d", str, &loopNum, &numIters);
-            int startCmd = loopStartIndex.takeLast();
-            std::cout << "Loopend starting cmd = " << startCmd << "\n";
-            stepperObj.queueLoopEndCmd(1, startCmd, numIters);
+    }
+    // (Re)load the programs, the stepper keeps the compiled commands so an unchanged
+    // program doesn't have to be converted again...
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (stepperObj.loadProgram(n, programs[n].constData(), programs[n].size()) < 0) {
+            rtLog(LOG_ERROR, "Couldn't queue the motion commands for motor %d!", n + 1);
+            stepperObj.clearAll();
+            return;
         }
     }
-    // And start...
+    // And start, a new run isn't held...
+    stepperObj.feedResume();
+    ui->step_hold->setText("Hold");
+    stepperObj.startAll();
+}
+
+// The last run didn't finish, carry on from its last checkpoint if that's what's wanted...
+void MainWindow::offerResume()
+{
+    if (QMessageBox::question(this, "Resume", "The last run was interrupted.\nPick up where it got to?",
+                              QMessageBox::Yes | QMessageBox::No) != QMessageBox::Yes)
+        return;
+    if (stepperObj.resumeFromJournal() < 0) {
+        QMessageBox::warning(this, "Resume", "Sorry, the last run can't be picked up.");
+        return;
+    }
+    rtLog(LOG_INFO, "Resuming the last run");
     stepperObj.startAll();
 }
 
 void MainWindow::on_step_stop_clicked()
 {
-    std::cout << "Stop everything!\n";
+    rtLog(LOG_INFO, "Stop everything!");
+    stopGcode();
     stepperObj.resetAll();
+    ui->step_hold->setText("Hold");
+}
+
+// Feed hold: slow everything down to a stop without losing our place, or carry on
+// from where we stopped.  A G-code file keeps its place too...
+void MainWindow::on_step_hold_clicked()
+{
+    if (stepperObj.feedHoldRequested()) {
+        rtLog(LOG_INFO, "Resume");
+        stepperObj.feedResume();
+        ui->step_hold->setText("Hold");
+    }
+    else {
+        rtLog(LOG_INFO, "Feed hold");
+        stepperObj.feedHold();
+        ui->step_hold->setText("Resume");
+    }
+}
+
+// Run a G-code file.  The first chunk of it is queued and started straight away, after
+// that there's always another chunk waiting as the stepper's next program...
+void MainWindow::on_step_gcode_clicked()
+{
+    QString path = QFileDialog::getOpenFileName(this, "Run G-code", QString(), "G-code (*.gcode *.nc *.ngc *.tap);;All files (*)");
+    if (path.isEmpty())
+        return;
+    stopGcode();
+    stepperObj.clearAll();
+    machineState state;
+    stepperObj.getMachineState(&state);
+    double startPos[NUM_MOTORS], stepsPerMM[NUM_MOTORS];
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        startPos[n] = state.motor[n].positionMM;
+        stepsPerMM[n] = stepperObj.getStepsPerMM(n);
+    }
+    if (!gcode.open(path.toLocal8Bit().constData(), startPos, stepsPerMM))
+        return;
+    const stepperProgramCmd *cmds[NUM_MOTORS];
+    int numCmds[NUM_MOTORS];
+    gcode.nextChunk(gcodeChunk);
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        cmds[n] = gcodeChunk[n].constData();
+        numCmds[n] = gcodeChunk[n].size();
+    }
+    if (stepperObj.queueBatchAll(cmds, numCmds) < 0) {
+        rtLog(LOG_ERROR, "Couldn't queue the G-code!");
+        stopGcode();
+        return;
+    }
+    feedGcode();
+    stepperObj.feedResume();
+    ui->step_hold->setText("Hold");
+    stepperObj.startAll();
+    gcodeTimer.start(GCODE_FEED_POLL_MS);
+}
+
+// Parse the next chunk of G-code once the last one's been swapped in.  Every chunk runs
+// for GCODE_CHUNK_SECS, many polls, so the next one's always queued before it's needed...
+void MainWindow::feedGcode()
+{
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (stepperObj.nextProgramPending(n))
+            return;
+    }
+    if (gcode.nextChunk(gcodeChunk) == 0) {
+        rtLog(LOG_INFO, "G-code all queued (%ld lines)", gcode.getLineNum());
+        stopGcode();
+        return;
+    }
+    const stepperProgramCmd *cmds[NUM_MOTORS];
+    int numCmds[NUM_MOTORS];
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        cmds[n] = gcodeChunk[n].constData();
+        numCmds[n] = gcodeChunk[n].size();
+    }
+    if (stepperObj.queueNextProgramAll(cmds, numCmds) < 0) {
+        rtLog(LOG_ERROR, "Couldn't queue G-code up to line %ld!", gcode.getLineNum());
+        stopGcode();
+    }
+}
+
+void MainWindow::stopGcode()
+{
+    gcodeTimer.stop();
+    gcode.close();
 }
 
 void MainWindow::on_step1_clearAll_clicked()
@@ -418,3 +537,22 @@ void MainWindow::on_step2_moveDown_clicked()
     if (currRow < 0)
         return;
 }
+
+void MainWindow::updateStatus()
+{
+    machineState state;
+    stepperObj.getMachineState(&state);
+    QString status;
+    static const char *holdText[] = {"", "  slowing", "  held"};
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        const motorState &ms = state.motor[n];
+        status += QString("Stepper %1: %2 mm  cmd %3/%4  %5 steps/s%6\n")
+                .arg(n + 1)
+                .arg(ms.positionMM, 0, 'f', 3)
+                .arg(ms.currQueuedCmd)
+                .arg(ms.numQueuedCmds)
+                .arg(ms.velocity, 0, 'f', 0)
+                .arg(holdText[ms.hold]);
+    }
+    ui->infoText->setPlainText(status.trimmed());
+}
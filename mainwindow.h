@@ -2,8 +2,13 @@
 #define MAINWINDOW_H
 
 #include <QMainWindow>
+#include <QTimer>
+#include <QVector>
+#include <QListWidget>
 
 #include "stepper.h"
+#include "ipcserver.h"
+#include "gcodestream.h"
 
 namespace Ui {
 class MainWindow;
@@ -20,6 +25,7 @@ public:
 private slots:
     void on_step_execute_clicked();
     void on_step_stop_clicked();
+    void on_step_hold_clicked();
     void on_step1_clearAll_clicked();
     void on_step1_clearSelected_clicked();
     void on_step1_motionQueue_currentRowChanged(int currentRow);
@@ -48,10 +54,32 @@ private slots:
 
     void on_step2_moveDown_clicked();
 
+    void updateStatus();
+
+    void on_step_gcode_clicked();
+
+    void feedGcode();
+
+    void step1_programChanged();
+
+    void step2_programChanged();
+
+    void offerResume();
+
 private:
     Ui::MainWindow *ui;
     stepper stepperObj;
+    ipcServer cmdServer;
     int stepperLoops[NUM_MOTORS];
+    QTimer statusTimer;
+    QVector<stepperProgramCmd> programs[NUM_MOTORS];
+    bool programDirty[NUM_MOTORS];
+    gcodeStream gcode;
+    QTimer gcodeTimer;
+    QVector<stepperProgramCmd> gcodeChunk[NUM_MOTORS];
+    void stopGcode();
+    void watchMotionQueue(QListWidget *motionQueue, const char *slot);
+    void parseMotionQueue(QListWidget *motionQueue, QVector<stepperProgramCmd> &program);
 };
 
 #endif // MAINWINDOW_H
@@ -0,0 +1,176 @@
+#include "motionplot.h"
+
+#include <QPainter>
+#include <float.h>
+
+static const QColor motorColors[] = {Qt::blue, Qt::red, Qt::darkGreen, Qt::magenta};
+
+MotionPlot::MotionPlot(QWidget *parent) :
+    QWidget(parent)
+{
+    stepperSrc = NULL;
+    history.resize(PLOT_MAX_COLUMNS);
+    historyHead = 0;
+    historyCount = 0;
+    resetBucket(&currBucket);
+    bucketEnd = 0;
+    timeSpan = 10.0;
+    bucketSpan = 0;
+    haveFirst = false;
+    for (int n = 0; n < NUM_MOTORS; n++)
+        haveLast[n] = false;
+    setMinimumHeight(120);
+    setAttribute(Qt::WA_OpaquePaintEvent);
+    // Refresh at ~60 fps...
+    connect(&refreshTimer, SIGNAL(timeout()), this, SLOT(pollTelemetry()));
+    refreshTimer.start(16);
+}
+
+void MotionPlot::setSource(stepper *source)
+{
+    stepperSrc = source;
+}
+
+void MotionPlot::setTimeSpan(double seconds)
+{
+    timeSpan = seconds;
+    bucketSpan = 0;
+}
+
+void MotionPlot::resetBucket(plotBucket *bucket)
+{
+    bucket->valid = false;
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        bucket->minPos[n] = DBL_MAX;
+        bucket->maxPos[n] = -DBL_MAX;
+        bucket->minRate[n] = DBL_MAX;
+        bucket->maxRate[n] = -DBL_MAX;
+    }
+}
+
+// Push the current bucket into the history ring and start a new one...
+void MotionPlot::closeBucket()
+{
+    history[historyHead] = currBucket;
+    historyHead = (historyHead + 1) % PLOT_MAX_COLUMNS;
+    if (historyCount < PLOT_MAX_COLUMNS) historyCount++;
+    resetBucket(&currBucket);
+}
+
+// Fold one telemetry sample into the min/max buckets...
+void MotionPlot::addSample(const telemetrySample &sample)
+{
+    if (!haveFirst) {
+        haveFirst = true;
+        bucketEnd = sample.time + bucketSpan;
+    }
+    // Close out any buckets we've passed, leaving gaps for stretches with no data...
+    while (sample.time >= bucketEnd) {
+        closeBucket();
+        bucketEnd += bucketSpan;
+        if (sample.time - bucketEnd > bucketSpan * PLOT_MAX_COLUMNS)
+            bucketEnd = sample.time + bucketSpan;
+    }
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (!(sample.motorMask & (1 << n)))
+            continue;
+        long long int dt = sample.time - lastTime[n];
+        if (haveLast[n] && dt > 0) {
+            double pos = (double)sample.position[n];
+            double rate = (double)(sample.position[n] - lastPos[n]) * 1000000.0 / (double)dt;
+            currBucket.valid = true;
+            if (pos < currBucket.minPos[n]) currBucket.minPos[n] = pos;
+            if (pos > currBucket.maxPos[n]) currBucket.maxPos[n] = pos;
+            if (rate < currBucket.minRate[n]) currBucket.minRate[n] = rate;
+            if (rate > currBucket.maxRate[n]) currBucket.maxRate[n] = rate;
+        }
+        haveLast[n] = true;
+        lastTime[n] = sample.time;
+        lastPos[n] = sample.position[n];
+    }
+}
+
+// Drain the telemetry ring and schedule a repaint...
+void MotionPlot::pollTelemetry()
+{
+    if (!stepperSrc)
+        return;
+    // One bucket per pixel column across the time span...
+    int columns = qMax(1, qMin(width(), PLOT_MAX_COLUMNS));
+    long long int span = (long long int)(timeSpan * 1000000.0 / columns);
+    if (span < 1) span = 1;
+    if (span != bucketSpan) {
+        bucketSpan = span;
+        historyCount = 0;
+        resetBucket(&currBucket);
+        haveFirst = false;
+    }
+    int numRead;
+    do {
+        numRead = stepperSrc->readTelemetry(readBuf, PLOT_READ_CHUNK);
+        for (int i = 0; i < numRead; i++)
+            addSample(readBuf[i]);
+    } while (numRead == PLOT_READ_CHUNK);
+    update();
+}
+
+// Draw one min/max trace per motor into the given area...
+void MotionPlot::drawTrace(QPainter &painter, const QRect &area, bool rate)
+{
+    int columns = qMin(area.width(), historyCount);
+    if (columns <= 0)
+        return;
+    // Find the range to scale to...
+    double lo = DBL_MAX, hi = -DBL_MAX;
+    for (int c = 0; c < columns; c++) {
+        const plotBucket &b = history[(historyHead - columns + c + PLOT_MAX_COLUMNS) % PLOT_MAX_COLUMNS];
+        if (!b.valid) continue;
+        for (int n = 0; n < NUM_MOTORS; n++) {
+            double bmin = rate ? b.minRate[n] : b.minPos[n];
+            double bmax = rate ? b.maxRate[n] : b.maxPos[n];
+            if (bmin > bmax) continue;
+            if (bmin < lo) lo = bmin;
+            if (bmax > hi) hi = bmax;
+        }
+    }
+    if (lo > hi)
+        return;
+    if (hi - lo < 1.0) {
+        lo -= 0.5;
+        hi += 0.5;
+    }
+    double scale = (double)(area.height() - 1) / (hi - lo);
+    painter.setPen(Qt::darkGray);
+    painter.drawText(area.adjusted(2, 0, 0, 0), Qt::AlignTop | Qt::AlignLeft,
+                     QString("%1 %2").arg(rate ? "steps/s" : "steps").arg(hi, 0, 'f', 0));
+    painter.drawText(area.adjusted(2, 0, 0, 0), Qt::AlignBottom | Qt::AlignLeft,
+                     QString::number(lo, 'f', 0));
+    // One vertical min->max line per column, newest on the right...
+    int x0 = area.right() - columns + 1;
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        painter.setPen(motorColors[n % (int)(sizeof(motorColors) / sizeof(motorColors[0]))]);
+        for (int c = 0; c < columns; c++) {
+            const plotBucket &b = history[(historyHead - columns + c + PLOT_MAX_COLUMNS) % PLOT_MAX_COLUMNS];
+            if (!b.valid) continue;
+            double bmin = rate ? b.minRate[n] : b.minPos[n];
+            double bmax = rate ? b.maxRate[n] : b.maxPos[n];
+            if (bmin > bmax) continue;
+            int y1 = area.bottom() - (int)((bmin - lo) * scale);
+            int y2 = area.bottom() - (int)((bmax - lo) * scale);
+            painter.drawLine(x0 + c, y1, x0 + c, y2);
+        }
+    }
+}
+
+void MotionPlot::paintEvent(QPaintEvent *)
+{
+    QPainter painter(this);
+    painter.fillRect(rect(), Qt::white);
+    int half = height() / 2;
+    QRect posArea(0, 0, width(), half - 1);
+    QRect rateArea(0, half + 1, width(), height() - half - 1);
+    painter.setPen(Qt::lightGray);
+    painter.drawLine(0, half, width(), half);
+    drawTrace(painter, posArea, false);
+    drawTrace(painter, rateArea, true);
+}
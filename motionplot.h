@@ -0,0 +1,60 @@
+#ifndef MOTIONPLOT_H
+#define MOTIONPLOT_H
+
+#include <QWidget>
+#include <QTimer>
+#include <QVector>
+
+#include "stepper.h"
+
+#define PLOT_MAX_COLUMNS    2048    // Most buckets (pixel columns) we keep history for
+#define PLOT_READ_CHUNK     1024    // Telemetry samples read from the stepper at a time
+
+// Min/max summary of the telemetry samples that fall into one pixel column...
+struct plotBucket {
+    bool valid;
+    double minPos[NUM_MOTORS];
+    double maxPos[NUM_MOTORS];
+    double minRate[NUM_MOTORS];
+    double maxRate[NUM_MOTORS];
+};
+
+// Live plot of each motor's position and step rate, fed from the stepper telemetry ring...
+class MotionPlot : public QWidget
+{
+    Q_OBJECT
+
+public:
+    explicit MotionPlot(QWidget *parent = 0);
+    void setSource(stepper *source);
+    void setTimeSpan(double seconds);
+
+protected:
+    void paintEvent(QPaintEvent *event);
+
+private slots:
+    void pollTelemetry();
+
+private:
+    stepper *stepperSrc;
+    QTimer refreshTimer;
+    telemetrySample readBuf[PLOT_READ_CHUNK];
+    QVector<plotBucket> history;    // Ring of completed buckets
+    int historyHead;                // Next slot to fill
+    int historyCount;               // Number of valid buckets
+    plotBucket currBucket;          // Bucket currently being accumulated
+    long long int bucketEnd;        // System time (uS) when the current bucket closes
+    long long int bucketSpan;       // Duration (uS) of one bucket
+    double timeSpan;                // Seconds shown across the plot
+    bool haveFirst;
+    bool haveLast[NUM_MOTORS];
+    long long int lastTime[NUM_MOTORS];     // Previous sample for each motor, they can
+    long long int lastPos[NUM_MOTORS];      // come from different axis groups
+    //
+    void resetBucket(plotBucket *bucket);
+    void addSample(const telemetrySample &sample);
+    void closeBucket();
+    void drawTrace(QPainter &painter, const QRect &area, bool rate);
+};
+
+#endif // MOTIONPLOT_H
@@ -1,6 +1,8 @@
 #ifndef PI_STEPPER_PINS_H
 #define PI_STEPPER_PINS_H
 
+#include "machinestate.h"
+
 // Stepper motor GPIO pin assignents on the Raspberry PI:
 int stepPins[] = {0, 4};    // BCM_GPIO pins {17, 23}, Header {11, 16}
 int dirPins[] = {1, 5};     // BCM_GPIO pins {18, 24}, Header {12, 18}
@@ -8,4 +10,20 @@ int llPins[] = {2, 6};      // BCM_GPIO pins {27, 25}, Header {13, 22}
 int ulPins[] = {3, 7};      // BCM_GPIO pins {22,  4}, Header {15,  7}
 int enablePins[] = {8, 9};  // BCM_GPIO pins { 2,  3}, Header { 3,  5}
 
+// Microstep select pins {MS1, MS2, MS3} for each motor, -1 if not wired.
+// With them wired, fast cruising moves switch the driver to coarse microsteps.
+// e.g. {{21, 22, 23}, {24, 25, 26}} - BCM_GPIO pins {5, 6, 13}, {19, 26, 12}
+int msPins[][3] = {{-1, -1, -1}, {-1, -1, -1}};
+// Select pin levels for fine (the resolution STEPS_PER_MM is in) and coarse steps, and
+// how many fine steps a coarse one is.  These are A4988 1/16 and 1/2 steps...
+int msFineLevels[3] = {1, 1, 1};
+int msCoarseLevels[3] = {1, 0, 0};
+int msCoarseRatio = 8;
+
+// Axis group (step thread) that services each motor, and the core each group's thread
+// is pinned to.  Put groups on separate cores of multi-core boards, see NUM_AXIS_GROUPS
+// (machinestate.h).  Sized so a list that's too long won't compile...
+int motorGroups[NUM_MOTORS] = {0, 0};
+int groupCpus[NUM_AXIS_GROUPS] = {3};
+
 #endif // PI_STEPPER_PINS_H
@@ -0,0 +1,94 @@
+/*
+*************************************
+* precisiontimer.cpp:
+*   Hit absolute deadlines to within a few microseconds
+*   without spinning for the whole interval
+*************************************
+*/
+
+#include <time.h>
+#include <errno.h>
+
+#include "precisiontimer.h"
+
+precisionTimer::precisionTimer()
+{
+    margin = PTIMER_INIT_MARGIN;
+    latencyAvg = PTIMER_INIT_MARGIN / 2;
+    latencyDev = PTIMER_INIT_MARGIN / (2 * PTIMER_DEV_MULT);
+    numWaits = 0;
+    numLate = 0;
+    maxLateness = 0;
+}
+
+// Current CLOCK_MONOTONIC time in nS...
+long long int precisionTimer::now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long int)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+// Sleep (no spinning) until an absolute deadline...
+void precisionTimer::sleepUntil(long long int deadline)
+{
+    struct timespec ts;
+    ts.tv_sec = deadline / 1000000000LL;
+    ts.tv_nsec = deadline % 1000000000LL;
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// Fold a wake latency into the running averages and work out the new margin...
+void precisionTimer::updateMargin(long long int latency)
+{
+    double diff = (double)latency - latencyAvg;
+    latencyAvg += diff / PTIMER_SMOOTHING;
+    latencyDev += ((diff < 0 ? -diff : diff) - latencyDev) / PTIMER_SMOOTHING;
+    double estimate = latencyAvg + PTIMER_DEV_MULT * latencyDev;
+    // A wakeup that blew right through the margin means we need to back off now,
+    // not after the averages catch up...
+    if (latency > estimate) estimate = latency;
+    setMargin(estimate);
+}
+
+// Nothing to learn from a wait we had to spin all the way through, so let the estimate
+// drift down.  If the latency really is that bad the next sleep puts it straight back...
+void precisionTimer::decayMargin(void)
+{
+    latencyAvg -= latencyAvg / PTIMER_DECAY;
+    latencyDev -= latencyDev / PTIMER_DECAY;
+    setMargin(latencyAvg + PTIMER_DEV_MULT * latencyDev);
+}
+
+void precisionTimer::setMargin(double estimate)
+{
+    long long int newMargin = (long long int)estimate;
+    if (newMargin < PTIMER_MIN_MARGIN) newMargin = PTIMER_MIN_MARGIN;
+    if (newMargin > PTIMER_MAX_MARGIN) newMargin = PTIMER_MAX_MARGIN;
+    margin = newMargin;
+}
+
+// Wait until an absolute CLOCK_MONOTONIC deadline (nS).
+// Returns how late (nS) we were when we got there...
+long long int precisionTimer::waitUntil(long long int deadline)
+{
+    long long int t = now();
+    numWaits++;
+    // Sleep if there's enough time, then see how late the kernel woke us...
+    long long int wakeTarget = deadline - margin;
+    if (wakeTarget > t) {
+        sleepUntil(wakeTarget);
+        t = now();
+        updateMargin(t - wakeTarget);
+    }
+    else
+        decayMargin();
+    // Spin for the rest...
+    while (t < deadline)
+        t = now();
+    long long int lateness = t - deadline;
+    if (lateness > PTIMER_LATE_TOLERANCE) numLate++;
+    if (lateness > maxLateness) maxLateness = lateness;
+    return(lateness);
+}
@@ -0,0 +1,42 @@
+#ifndef PRECISIONTIMER_H
+#define PRECISIONTIMER_H
+
+#define PTIMER_MIN_MARGIN     5000      // Never sleep closer than this (nS) to a deadline
+#define PTIMER_MAX_MARGIN     500000    // Never spin for longer than this (nS)
+#define PTIMER_INIT_MARGIN    10000     // Starting margin (nS), well inside the shortest cycle so we get to sleep and learn
+#define PTIMER_SMOOTHING      16        // Weight of the running wake latency averages
+#define PTIMER_DEV_MULT       4         // Margin = average + PTIMER_DEV_MULT * deviation
+#define PTIMER_LATE_TOLERANCE 2000      // Lateness (nS) we count as a missed deadline
+#define PTIMER_DECAY          4096      // Waits with no sleep it takes the estimate to drop by about 1/e
+
+// Hybrid sleep-then-spin wait on absolute CLOCK_MONOTONIC deadlines.
+// Sleeps with clock_nanosleep(TIMER_ABSTIME) until a margin before the deadline, then
+// spins on the clock for the rest.  The margin follows the observed wake latency so we
+// spin as little as possible while still hitting deadlines within a few microseconds.
+// A wait too short to sleep teaches us nothing, so the estimate slowly decays instead -
+// otherwise one bad wakeup could push the margin past the cycle time and we'd spin for good...
+class precisionTimer {
+private:
+    long long int margin;       // How early (nS) to wake up before a deadline
+    double latencyAvg;          // Running average of wake latency (nS)
+    double latencyDev;          // Running average deviation of wake latency (nS)
+    long long int numWaits;
+    long long int numLate;      // Deadlines we woke up after
+    long long int maxLateness;  // Worst lateness seen (nS)
+    //
+    void updateMargin(long long int latency);
+    void decayMargin(void);
+    void setMargin(double estimate);
+
+public:
+    precisionTimer();
+    static long long int now(void);
+    long long int waitUntil(long long int deadline);
+    void sleepUntil(long long int deadline);
+    long long int getMargin(void) { return(margin); }
+    long long int getNumWaits(void) { return(numWaits); }
+    long long int getNumLate(void) { return(numLate); }
+    long long int getMaxLateness(void) { return(maxLateness); }
+};
+
+#endif // PRECISIONTIMER_H
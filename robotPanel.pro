@@ -14,18 +14,46 @@ TEMPLATE = app
 
 SOURCES += main.cpp\
         mainwindow.cpp \
-    stepper.cpp
+    stepper.cpp \
+    motionplot.cpp \
+    precisiontimer.cpp \
+    clocksource.cpp \
+    ipcserver.cpp \
+    rtlog.cpp \
+    gpio.cpp \
+    stepprofile.cpp \
+    gcodestream.cpp \
+    journal.cpp
 
 HEADERS  += mainwindow.h \
     stepper.h \
-    pi_stepper_pins.h
+    stepplan.h \
+    pi_stepper_pins.h \
+    motionplot.h \
+    precisiontimer.h \
+    clocksource.h \
+    machinestate.h \
+    ipcprotocol.h \
+    ipcserver.h \
+    rtlog.h \
+    gpio.h \
+    stepprofile.h \
+    gcodestream.h \
+    journal.h
 
 FORMS    += mainwindow.ui
 
-win32:CONFIG(release, debug|release): LIBS += -L$$PWD/../../../../../usr/local/lib/release/ -lwiringPi
-else:win32:CONFIG(debug, debug|release): LIBS += -L$$PWD/../../../../../usr/local/lib/debug/ -lwiringPi
-else:symbian: LIBS += -lwiringPi
-else:unix: LIBS += -L$$PWD/../../../../../usr/local/lib/ -lwiringPi
+# qmake CONFIG+=sim_gpio or CONFIG+=chardev_gpio builds without wiringPi, see gpio.h...
+sim_gpio {
+    DEFINES += GPIO_SIM
+} else:chardev_gpio {
+    DEFINES += GPIO_CHARDEV
+} else {
+    win32:CONFIG(release, debug|release): LIBS += -L$$PWD/../../../../../usr/local/lib/release/ -lwiringPi
+    else:win32:CONFIG(debug, debug|release): LIBS += -L$$PWD/../../../../../usr/local/lib/debug/ -lwiringPi
+    else:symbian: LIBS += -lwiringPi
+    else:unix: LIBS += -L$$PWD/../../../../../usr/local/lib/ -lwiringPi
+}
 
 INCLUDEPATH += $$PWD/../../../../../usr/local/include
 DEPENDPATH += $$PWD/../../../../../usr/local/include
@@ -0,0 +1,307 @@
+/*
+*************************************
+* rtlog.cpp:
+*   Deferred formatting log that real-time threads can use
+*************************************
+*/
+
+#include <stdarg.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "rtlog.h"
+
+// One argument as captured by rtLog()...
+union rtLogArg {
+    long long int i;
+    double d;
+    const char *s;
+};
+
+// Argument types, worked out from the format string...
+#define ARG_INT         0
+#define ARG_LONG        1
+#define ARG_LLONG       2
+#define ARG_DOUBLE      3
+#define ARG_STRING      4
+#define ARG_POINTER     5
+
+struct rtLogRecord {
+    volatile unsigned int seq;  // Ring slot sequence (see rtLog())
+    int level;
+    long long int time;         // CLOCK_MONOTONIC (nS)
+    const char *fmt;
+    int numArgs;
+    unsigned char argTypes[RTLOG_MAX_ARGS];
+    rtLogArg args[RTLOG_MAX_ARGS];  // %s arguments are an offset into strings (-1 for NULL)
+    char strings[RTLOG_STRING_SIZE];
+};
+
+static rtLogRecord logRing[RTLOG_SIZE];
+static volatile unsigned int logHead;       // Next slot to claim (any thread)
+static unsigned int logTail;                // Next slot to write out (writer thread)
+static volatile unsigned long logDropped;
+static volatile int logLevel = LOG_INFO;
+static volatile bool logReady = false;
+static volatile bool logRunning = false;
+static FILE *logOut;
+static pthread_t logThread;
+static long long int logStartTime;
+
+static const char *levelNames[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+
+static long long int logNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long int)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+// Find the next conversion in a format string, returns a pointer just past it
+// (or NULL at the end) and its argument type (-1 for "%%")...
+static const char *nextConversion(const char *p, int *argType)
+{
+    while (*p && *p != '%') p++;
+    if (!*p)
+        return(NULL);
+    p++;
+    if (*p == '%') {
+        *argType = -1;
+        return(p + 1);
+    }
+    // Flags, width and precision...
+    while (*p && strchr("-+ #0123456789.", *p)) p++;
+    // Length...
+    int longs = 0;
+    while (*p == 'l') { longs++; p++; }
+    while (*p && strchr("hzjtL", *p)) p++;
+    switch (*p) {
+    case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': case 'c':
+        *argType = (longs >= 2)?ARG_LLONG:((longs == 1)?ARG_LONG:ARG_INT);
+        break;
+    case 'f': case 'F': case 'e': case 'E': case 'g': case 'G':
+        *argType = ARG_DOUBLE;
+        break;
+    case 's':
+        *argType = ARG_STRING;
+        break;
+    case 'p':
+        *argType = ARG_POINTER;
+        break;
+    default:
+        *argType = -1;
+        break;
+    }
+    return(*p ? p + 1 : p);
+}
+
+// Queue a log record.  Any thread can call this, it never blocks.
+// Bounded MPMC ring (after Dmitry Vyukov): a slot is free for position pos when its
+// seq == pos and holds a record for the writer when its seq == pos + 1...
+void rtLog(int level, const char *fmt, ...)
+{
+    if (!logReady || level < logLevel)
+        return;
+    unsigned int pos = logHead;
+    rtLogRecord *rec;
+    for (;;) {
+        rec = &logRing[pos & (RTLOG_SIZE - 1)];
+        int dif = (int)(rec->seq - pos);
+        if (dif == 0) {
+            if (__sync_bool_compare_and_swap(&logHead, pos, pos + 1))
+                break;
+        }
+        else if (dif < 0) {
+            __sync_fetch_and_add(&logDropped, 1);
+            return;
+        }
+        pos = logHead;
+    }
+    rec->level = level;
+    rec->time = logNow();
+    rec->fmt = fmt;
+    rec->numArgs = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    const char *p = fmt;
+    int argType;
+    int stringsUsed = 0;
+    const char *str;
+    while (rec->numArgs < RTLOG_MAX_ARGS && (p = nextConversion(p, &argType)) != NULL) {
+        rtLogArg *arg = &rec->args[rec->numArgs];
+        switch (argType) {
+        case ARG_INT: arg->i = va_arg(ap, int); break;
+        case ARG_LONG: arg->i = va_arg(ap, long); break;
+        case ARG_LLONG: arg->i = va_arg(ap, long long); break;
+        case ARG_DOUBLE: arg->d = va_arg(ap, double); break;
+        case ARG_STRING:
+            // Copy the string, the caller's copy may be gone by the time it's written out.
+            // Once there's no room left they're all empty (the last byte's always a 0)...
+            str = va_arg(ap, const char *);
+            if (!str) {
+                arg->i = -1;
+                break;
+            }
+            if (stringsUsed == RTLOG_STRING_SIZE) {
+                arg->i = RTLOG_STRING_SIZE - 1;
+                break;
+            }
+            arg->i = stringsUsed;
+            while (*str && stringsUsed < RTLOG_STRING_SIZE - 1)
+                rec->strings[stringsUsed++] = *str++;
+            rec->strings[stringsUsed++] = 0;
+            break;
+        case ARG_POINTER: arg->s = (const char *)va_arg(ap, void *); break;
+        default: continue;
+        }
+        rec->argTypes[rec->numArgs++] = argType;
+    }
+    va_end(ap);
+    __sync_synchronize();
+    rec->seq = pos + 1;
+}
+
+// Format one record and write it out...
+static void writeRecord(const rtLogRecord *rec)
+{
+    char line[512], spec[32];
+    int len = snprintf(line, sizeof(line), "[%12.6f] %s ",
+                       (rec->time - logStartTime) / 1e9, levelNames[rec->level & 3]);
+    const char *p = rec->fmt;
+    int argNum = 0;
+    while (*p && len < (int)sizeof(line) - 1) {
+        const char *start = p;
+        int argType;
+        // Copy literal text up to the next conversion...
+        while (*p && *p != '%') p++;
+        int n = p - start;
+        if (n > (int)sizeof(line) - 1 - len) n = sizeof(line) - 1 - len;
+        memcpy(line + len, start, n);
+        len += n;
+        if (!*p) break;
+        start = p;
+        p = nextConversion(p, &argType);
+        if (argType < 0 || argNum >= rec->numArgs) {
+            if (start[1] == '%' && len < (int)sizeof(line) - 1) line[len++] = '%';
+            continue;
+        }
+        // Re-run the conversion on its own with the saved argument...
+        n = p - start;
+        if (n >= (int)sizeof(spec)) n = sizeof(spec) - 1;
+        memcpy(spec, start, n);
+        spec[n] = 0;
+        const rtLogArg *arg = &rec->args[argNum++];
+        char *dst = line + len;
+        size_t room = sizeof(line) - len;
+        switch (argType) {
+        case ARG_INT: n = snprintf(dst, room, spec, (int)arg->i); break;
+        case ARG_LONG: n = snprintf(dst, room, spec, (long)arg->i); break;
+        case ARG_LLONG: n = snprintf(dst, room, spec, arg->i); break;
+        case ARG_DOUBLE: n = snprintf(dst, room, spec, arg->d); break;
+        case ARG_STRING: n = snprintf(dst, room, spec, (arg->i >= 0) ? rec->strings + arg->i : "(null)"); break;
+        case ARG_POINTER: n = snprintf(dst, room, spec, (const void *)arg->s); break;
+        }
+        if (n > 0) len += ((size_t)n < room)?n:room - 1;
+    }
+    line[len] = 0;
+    fputs(line, logOut);
+    if (len == 0 || line[len - 1] != '\n')
+        fputc('\n', logOut);
+}
+
+// Write out every record that's ready...
+static void drainLog(void)
+{
+    bool wrote = false;
+    for (;;) {
+        rtLogRecord *rec = &logRing[logTail & (RTLOG_SIZE - 1)];
+        if (rec->seq != logTail + 1)
+            break;
+        __sync_synchronize();
+        writeRecord(rec);
+        __sync_synchronize();
+        rec->seq = logTail + RTLOG_SIZE;
+        logTail++;
+        wrote = true;
+    }
+    if (wrote)
+        fflush(logOut);
+}
+
+// Write out everything that's waiting and own up to anything we lost...
+static void flushLog(unsigned long *reported)
+{
+    drainLog();
+    if (logDropped != *reported) {
+        fprintf(logOut, "rtlog: %lu records dropped\n", logDropped - *reported);
+        fflush(logOut);
+        *reported = logDropped;
+    }
+}
+
+static void *logThreadMain(void *)
+{
+    struct timespec delay;
+    delay.tv_sec = 0;
+    delay.tv_nsec = RTLOG_FLUSH_NS;
+    unsigned long reported = 0;
+    while (logRunning) {
+        flushLog(&reported);
+        nanosleep(&delay, NULL);
+    }
+    flushLog(&reported);
+    return(NULL);
+}
+
+// Set up the ring and start the writer thread...
+void rtLogStart(FILE *out)
+{
+    if (logReady)
+        return;
+    logOut = out;
+    for (unsigned int n = 0; n < RTLOG_SIZE; n++)
+        logRing[n].seq = n;
+    logHead = 0;
+    logTail = 0;
+    logDropped = 0;
+    logStartTime = logNow();
+    __sync_synchronize();
+    logReady = true;
+    // The writer isn't real-time, don't inherit anyone's RT scheduling...
+    pthread_attr_t attr;
+    struct sched_param param;
+    param.sched_priority = 0;
+    pthread_attr_init(&attr);
+    pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+    pthread_attr_setschedpolicy(&attr, SCHED_OTHER);
+    pthread_attr_setschedparam(&attr, &param);
+    logRunning = true;
+    if (pthread_create(&logThread, &attr, &logThreadMain, NULL)) {
+        fprintf(stderr, "Unable to start log thread?\n");
+        logRunning = false;
+    }
+    pthread_attr_destroy(&attr);
+}
+
+// Write out anything left and stop the writer thread.
+// Turn new records away first, there'd be nobody to write them out...
+void rtLogStop(void)
+{
+    logReady = false;
+    if (logRunning) {
+        logRunning = false;
+        pthread_join(logThread, NULL);
+    }
+}
+
+void rtLogSetLevel(int level)
+{
+    logLevel = level;
+}
+
+unsigned long rtLogDropped(void)
+{
+    return(logDropped);
+}
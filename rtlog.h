@@ -0,0 +1,33 @@
+#ifndef RTLOG_H
+#define RTLOG_H
+
+#include <stdio.h>
+
+// Log levels...
+#define LOG_DEBUG           0
+#define LOG_INFO            1
+#define LOG_WARN            2
+#define LOG_ERROR           3
+
+#define RTLOG_SIZE          4096    // Records in the log ring (must be a power of two)
+#define RTLOG_MAX_ARGS      10      // Most arguments a log message can have
+#define RTLOG_STRING_SIZE   128     // Room in a record for its %s arguments, longer ones are cut short
+#define RTLOG_FLUSH_NS      10000000 // How often (nS) the writer thread wakes up
+
+// Leveled logging that's safe to call from the step threads.
+// rtLog() copies the format pointer and raw arguments into a fixed size record in a
+// lock-free ring, no formatting and no system calls.  A low priority thread formats
+// and writes the records out.  The format string is stored by pointer so it must be a
+// string literal, %s arguments are copied into the record so they can be anything.
+// If the ring is full the record is dropped and counted, after rtLogStop() nothing's kept...
+void rtLogStart(FILE *out = stdout);
+void rtLogStop(void);
+void rtLogSetLevel(int level);
+void rtLog(int level, const char *fmt, ...)
+#ifdef __GNUC__
+    __attribute__((format(printf, 2, 3)))
+#endif
+    ;
+unsigned long rtLogDropped(void);
+
+#endif // RTLOG_H
@@ -15,84 +15,101 @@
 #include <fcntl.h>
 
 #include <unistd.h>
-#include <wiringPi.h>
 #include <math.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "stepper.h"
+#include "gpio.h"
+#include "rtlog.h"
 
 #include "pi_stepper_pins.h"
 
-#define ST_BASE             (0x20003000)
-#define TIMER_OFFSET        (4)
 #define PULSE_WIDTH_DELAY   50
-#define MIN_LOOPS_PER_STEP  15
-#define STEPS_PER_MM        441
-
-// Map the 1mHz system timer on the Raspberry Pi into our memory space
-// From: http://mindplusplus.wordpress.com/2013/05/21/accessing-the-raspberry-pis-1mhz-timer/
-void stepper::initSysTime()
-{
-    fd = -1;
-    timer = NULL;
-    void *st_base; // byte ptr to simplify offset math
-    // Set up access to the system core memory...
-    if (-1 == (fd = open("/dev/mem", O_RDONLY))) {
-        fprintf(stderr, "open() failed.\n");
-        return;
-    }
-    //  Map the timer's page into the process' address space...
-    if (MAP_FAILED == (st_base = mmap(NULL, 4096, PROT_READ, MAP_SHARED, fd, ST_BASE))) {
-        fprintf(stderr, "mmap() failed.\n");
-        fclose((FILE *)fd);
-        fd = -1;
-        return;
-    }
-    // Set the pointer to the timer based on the mapped page...
-    timer = (long long int *)((char *)st_base + TIMER_OFFSET);
-}
+#define DIR_SETUP_NS        1000    // DIR has to settle this long before STEP rises (A4988 200 nS, DRV8825 650 nS)
+
+// Holds the control lock for as long as it's in scope, so the GUI and the IPC
+// server can't be in the middle of changing the same motor's queue at once...
+class controlGuard {
+private:
+    pthread_mutex_t *lock;
+public:
+    controlGuard(pthread_mutex_t *lock) { this->lock = lock; pthread_mutex_lock(lock); }
+    ~controlGuard() { pthread_mutex_unlock(lock); }
+};
 
 // Constructor - initialize everything...
 stepper::stepper()
 {
-    // Put us on the RT scheduler and give us a high priority...
+    // Every public control call holds this, they call each other so it's recursive...
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+    pthread_mutex_init(&controlLock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    // Put us on the RT scheduler and give us a high priority (the step threads inherit it).
+    // Without root (or CAP_SYS_NICE) we still run, the steps are just at the mercy of everything else...
     struct sched_param param;
     param.sched_priority = sched_get_priority_max(SCHED_FIFO);
     if ( sched_setscheduler( 0, SCHED_FIFO, &param ) == -1 ) {
-      perror("sched_setscheduler");
-      return;
+      rtLog(LOG_WARN, "Can't get real-time scheduling, carrying on without it");
     }
     // Lock memory to ensure no swapping is done...
     if (mlockall(MCL_FUTURE|MCL_CURRENT)) {
-      fprintf(stderr,"WARNING: Failed to lock memory\n");
+      rtLog(LOG_WARN, "Failed to lock memory");
     }
-    // Set up access to the 1 mHz system timer...
-    initSysTime();
+    // Set up access to the 1 MHz system timer...
+    sysClock.init();
+    rtLog(LOG_INFO, "System clock: %s", sysClock.name());
     // Set up to drive the Pi's GPIO pins...
-    wiringPiSetup () ;
+    gpioInit();
     // Set up the parameters needed to drive the individual stepper motors...
     for (int n = 0; n < NUM_MOTORS; n++) {
         stepData[n].stepPin = stepPins[n];
-        pinMode (stepData[n].stepPin, OUTPUT);
-        digitalWrite (stepData[n].stepPin, LOW);
+        gpioOutput(stepData[n].stepPin, LOW);
         //
         stepData[n].dirPin = dirPins[n];
-        pinMode (stepData[n].dirPin, OUTPUT);
-        digitalWrite (stepData[n].dirPin, LOW);
+        gpioOutput(stepData[n].dirPin, LOW);
+        stepData[n].dirLevel = LOW;
         //
         stepData[n].enablePin = enablePins[n];
-        pinMode (stepData[n].enablePin, OUTPUT);
-        digitalWrite (stepData[n].enablePin, HIGH);
+        gpioOutput(stepData[n].enablePin, HIGH);
         stepData[n].enabled = false;
         //
+        // Microstep select pins, if they're wired we can switch to coarse steps when cruising...
+        stepData[n].axis.msRatio = 1;
+        for (int ms = 0; ms < 3; ms++) {
+            stepData[n].msPins[ms] = msPins[n][ms];
+            if (msPins[n][ms] >= 0) {
+                gpioOutput(msPins[n][ms], msFineLevels[ms]);
+                stepData[n].axis.msRatio = msCoarseRatio;
+            }
+        }
+        stepData[n].axis.msCruiseCycles = MS_CRUISE_LOOPS_PER_STEP;
+        stepData[n].stepSize = 1;
+        setMicrostep(n, 1);
+        //
         stepData[n].stepping = false;
+        stepData[n].startTime = 0;
+        stepData[n].holdState = HOLD_NONE;
         stepData[n].currQueuedCmd = 0;
+        stepData[n].position = 0;
+        stepData[n].loopDepth = 0;
+        stepData[n].cmdTable = NULL;
+        stepData[n].cmdTableSize = 0;
+        stepData[n].numQueuedCmds = 0;
+        stepData[n].programBlock = NULL;
+        stepData[n].cachedProgram = NULL;
+        stepData[n].cachedProgramSize = 0;
+        stepData[n].cachedProgramHash = 0;
+        stepData[n].nextProgram = NULL;
+        stepData[n].retiredProgram = NULL;
         pthread_mutex_init(&(stepData[n].lock), NULL);
         //SRR ToDo *****************************************
         // stepsPerMM and minCyclesPerStep SHOULD ideally be set from a configuration file!!!!!!
-//        stepData[n].minCyclesPerStep = 20;
-        stepData[n].minCyclesPerStep = MIN_LOOPS_PER_STEP;
-        stepData[n].stepsPerMM = STEPS_PER_MM;
+//        stepData[n].axis.minCyclesPerStep = 20;
+        stepData[n].axis.minCyclesPerStep = MIN_LOOPS_PER_STEP;
+        stepData[n].axis.stepsPerMM = STEPS_PER_MM;
         //SRR ToDo *****************************************
         stepData[n].stepLogIndex = 0;
         for (int sli = 0; sli < STEP_LOG_SIZE; sli++)
@@ -102,71 +119,414 @@ stepper::stepper()
     // Set up our timers...
     enableDelay.tv_sec = 0;
     enableDelay.tv_nsec = 15000000;
-    cycleDelay.tv_sec = 0;
-    cycleDelay.tv_nsec = 23000;
+    cyclePeriod = CYCLE_PERIOD_NS;
+    cycleFreq = 1000000000.0 / (double)cyclePeriod;
+    //
+    // Share the motors out between the axis groups.  A motor put in a group that
+    // doesn't exist would never be stepped, or worse, so it goes in the first one...
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (motorGroups[n] < 0 || motorGroups[n] >= NUM_AXIS_GROUPS) {
+            rtLog(LOG_ERROR, "Motor %d is in axis group %d, there are only %d, using group 0", n + 1, motorGroups[n], NUM_AXIS_GROUPS);
+            motorGroups[n] = 0;
+        }
+    }
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+        axisGroup *grp = &groups[g];
+        grp->owner = this;
+        grp->groupNum = g;
+        grp->cpu = groupCpus[g];
+        grp->numMotors = 0;
+        for (int n = 0; n < NUM_MOTORS; n++) {
+            if (motorGroups[n] == g)
+                grp->motors[grp->numMotors++] = n;
+        }
+        grp->telemetryHead = 0;
+        grp->telemetryTail = 0;
+        grp->telemetryCountdown = TELEMETRY_DECIMATE;
+        grp->stateSeq = 0;
+        publishState(grp);
+        grp->profile.trace = NULL;
+        grp->profile.traceCount = 0;
+        grp->profile.generation = 0;
+        grp->checkpointDue = false;
+        grp->tickSeq = 0;
+        grp->sleeping = false;
+    }
+    profileFlags = 0;
+    holdRequested = false;
+    // Keep a journal of how far we've got (memory's locked by now, so its mapping is too)...
+    journalCycles = 0;
+    if (journal.open(NUM_AXIS_GROUPS))
+        setJournalInterval(JOURNAL_INTERVAL_MS);
+    profileGen = 0;
     //
     // Queue a priority command to the thread to check the loop frequency...
     pthread_mutex_init(&pc_lock, NULL);
+    pthread_mutex_init(&idleLock, NULL);
+    pthread_cond_init(&idleCond, NULL);
     stepperCmd *initCmd = new stepperCmd;
     initCmd->cmdType = STEPCMD_CHECK_LOOP_FREQ;
     initCmd->cycleCounter = 10000;
     priorityCmdList.append(initCmd);
     //
-    // Start the thread to loop forever or until it's told to stop, whichever comes first...
+    // Start a thread per group to loop forever or until it's told to stop, whichever comes first.
+    // They wait until they've all been created, then start cycling together at the common epoch.
+    // If any of them couldn't be started the rest are told to finish up as soon as they're let go...
     pthreadStatus = 0;
-    int iReturnValue = pthread_create(&sThread, NULL, &stepperThread1, (void *)this);
-    if (iReturnValue) {
-        printf("Unable to start stepperThread?\n");
+    groupsReleased = false;
+    cycleEpoch = precisionTimer::now() + GROUP_START_LEAD_NS;
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+        int iReturnValue = pthread_create(&groups[g].sThread, NULL, &stepperThread1, (void *)&groups[g]);
+        groups[g].started = (iReturnValue == 0);
+        if (iReturnValue) {
+            rtLog(LOG_ERROR, "Unable to start stepperThread %d?", g);
+            pthreadStatus = 1;
+        }
     }
+    pthread_mutex_lock(&idleLock);
+    groupsReleased = true;
+    pthread_cond_broadcast(&idleCond);
+    pthread_mutex_unlock(&idleLock);
 }
 
 // Destructor - make sure everything is turned off and cleaned up...
 stepper::~stepper()
 {
-    // Tell the thread to close and wait for it to terminate...
-    struct timespec waitTerminate, tim2;
-    waitTerminate.tv_sec = 0;
-    waitTerminate.tv_nsec = 10000000;
+    // Tell the threads to close and wait for them to terminate...
     pthreadStatus = 1;
-    while (pthreadStatus == 1) nanosleep(&waitTerminate, &tim2);
+    wakeStepperThread();
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++)
+        if (groups[g].started)
+            pthread_join(groups[g].sThread, NULL);
+    // A clean shutdown, there's nothing to pick up next time...
+    journal.invalidate();
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++)
+        delete [] groups[g].profile.trace;
     // Turn off the stepper motors...
     for (int n = 0; n < NUM_MOTORS; n++) {
+        setMicrostep(n, 1);
         // Stop everything from stepping and turn off power to the motors...
-        digitalWrite (stepData[n].stepPin, LOW);
-        digitalWrite (stepData[n].dirPin, LOW);
-        digitalWrite (stepData[n].enablePin, HIGH);
+        gpioWrite(stepData[n].stepPin, LOW);
+        gpioWrite(stepData[n].dirPin, LOW);
+        gpioWrite(stepData[n].enablePin, HIGH);
+        gpioCommit();
+        // Clear any queued commands...
+        freeCmds(n);
+        delete [] stepData[n].cmdTable;
+        delete [] stepData[n].cachedProgram;
         // FWIW - delete the mutex locks...
         pthread_mutex_destroy(&(stepData[n].lock));
-        // Clear any queued commands...
-        while (!stepData[n].queuedCmdList.isEmpty())
-            delete stepData[n].queuedCmdList.takeFirst();
     }
     // Clear the priority queue and delete the lock...
     while (!priorityCmdList.isEmpty())
         delete priorityCmdList.takeFirst();
     pthread_mutex_destroy(&pc_lock);
+    gpioShutdown();
+    pthread_cond_destroy(&idleCond);
+    pthread_mutex_destroy(&idleLock);
+    pthread_mutex_destroy(&controlLock);
 }
 
-// INLINE(?) code to read the current time from the memory mapped system timer...
+// Read the current time (uS) from the system clock source...
 inline long long int stepper::getSysTime(void)
 {
-    if (timer)
-        return(*timer);
-    else
-        return(0);
+    return(sysClock.read());
 }
 
-// Static(!?) method used to start the 'real' stepper motor thread...
-void * stepper::stepperThread1(void *p_this)
+// Push a telemetry sample for a group's motors into its ring - called from the group's thread only.
+// If the reader has fallen behind the sample is simply dropped...
+inline void stepper::publishTelemetry(axisGroup *grp)
 {
-    stepper *l_this = (stepper *)p_this;
-    l_this->stepperThread();
+    unsigned int head = grp->telemetryHead;
+    if (head - grp->telemetryTail >= TELEMETRY_SIZE)
+        return;
+    telemetrySample *sample = &grp->telemetry[head & (TELEMETRY_SIZE - 1)];
+    sample->time = getSysTime();
+    sample->motorMask = 0;
+    for (int gm = 0; gm < grp->numMotors; gm++) {
+        int n = grp->motors[gm];
+        sample->motorMask |= 1 << n;
+        sample->position[n] = stepData[n].position;
+    }
+    // Make sure the sample is visible before the reader can see the new head...
+    __sync_synchronize();
+    grp->telemetryHead = head + 1;
 }
 
-// 'Real' stepper motor thread that loops forever and drives the stepper motors...
-void stepper::stepperThread()
+// Copy out up to maxSamples of the pending telemetry, oldest first across all
+// the groups, returns the number copied...
+int stepper::readTelemetry(telemetrySample *samples, int maxSamples)
+{
+    unsigned int tail[NUM_AXIS_GROUPS], head[NUM_AXIS_GROUPS];
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+        tail[g] = groups[g].telemetryTail;
+        head[g] = groups[g].telemetryHead;
+    }
+    __sync_synchronize();
+    int numSamples = 0;
+    while (numSamples < maxSamples) {
+        int oldest = -1;
+        for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+            if (tail[g] == head[g]) continue;
+            if (oldest < 0 || groups[g].telemetry[tail[g] & (TELEMETRY_SIZE - 1)].time
+                    < groups[oldest].telemetry[tail[oldest] & (TELEMETRY_SIZE - 1)].time)
+                oldest = g;
+        }
+        if (oldest < 0)
+            break;
+        samples[numSamples++] = groups[oldest].telemetry[tail[oldest] & (TELEMETRY_SIZE - 1)];
+        tail[oldest]++;
+    }
+    // Don't release the slots until we're done copying them...
+    __sync_synchronize();
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++)
+        groups[g].telemetryTail = tail[g];
+    return(numSamples);
+}
+
+// Publish a group's part of the machine state snapshot through its seqlock - called
+// from the group's thread only.  The sequence number is odd while it's being written...
+inline void stepper::publishState(axisGroup *grp)
+{
+    grp->stateSeq++;
+    __sync_synchronize();
+    grp->stateTime = getSysTime();
+    for (int gm = 0; gm < grp->numMotors; gm++) {
+        int n = grp->motors[gm];
+        motorState *ms = &publishedState.motor[n];
+        ms->position = stepData[n].position;
+        ms->currQueuedCmd = stepData[n].currQueuedCmd;
+        ms->numQueuedCmds = stepData[n].numQueuedCmds;
+        ms->stepping = stepData[n].stepping;
+        ms->hold = stepData[n].holdState;
+        ms->stepInterval = 0;
+        ms->dir = 0;
+        if (ms->stepping && ms->currQueuedCmd < ms->numQueuedCmds) {
+            stepperCmd *cmd = stepData[n].cmdTable[ms->currQueuedCmd];
+            if ((cmd->cmdType == STEPCMD_MOVE || cmd->cmdType == STEPCMD_MOVE_TO) && cmd->dir) {
+                // A coarse pulse is stepSize fine steps...
+                ms->stepInterval = (double)cmd->numCycles / (double)stepData[n].stepSize;
+                ms->dir = cmd->dir;
+            }
+        }
+    }
+    __sync_synchronize();
+    grp->stateSeq++;
+}
+
+// Write a checkpoint of a group's motors into the journal - called from the group's
+// thread only.  Just memory writes, the journal's sync thread gets them to disk...
+inline void stepper::checkpoint(axisGroup *grp, long long int cycle)
+{
+    journalSlot *slot = journal.beginCheckpoint(grp->groupNum);
+    slot->cycle = cycle;
+    slot->motorMask = 0;
+    for (int gm = 0; gm < grp->numMotors; gm++) {
+        int n = grp->motors[gm];
+        stepperData *sd = &stepData[n];
+        journalMotor *jm = &slot->motor[n];
+        slot->motorMask |= 1 << n;
+        // Read the count before the table, see publishCmds()...
+        int numQueuedCmds = sd->numQueuedCmds;
+        __sync_synchronize();
+        stepperCmd **cmdTable = sd->cmdTable;
+        jm->programHash = sd->programBlock?sd->cachedProgramHash:0;
+        jm->position = sd->position;
+        jm->currQueuedCmd = sd->currQueuedCmd;
+        jm->numQueuedCmds = numQueuedCmds;
+        jm->moveDir = 0;
+        jm->moveTriggers = 0;
+        jm->moveLeft = 0;
+        if (jm->currQueuedCmd < numQueuedCmds && planMoveUnderWay(cmdTable[jm->currQueuedCmd])) {
+            stepperCmd *cmd = cmdTable[jm->currQueuedCmd];
+            jm->moveDir = cmd->dir;
+            jm->moveTriggers = cmd->numTriggers;
+            jm->moveLeft = cmd->triggerCounter;
+        }
+        jm->numLoops = (sd->loopDepth > JOURNAL_MAX_LOOPS)?-1:sd->loopDepth;
+        for (int l = 0; l < jm->numLoops; l++) {
+            jm->loopCmd[l] = sd->loopStack[l];
+            jm->loopCounter[l] = cmdTable[sd->loopStack[l]]->triggerCounter;
+        }
+    }
+    journal.commitCheckpoint(grp->groupNum);
+    grp->checkpointDue = false;
+}
+
+// Keep track of which loops a motor's inside, for the journal - called from the motor's
+// step thread only.  A loop end's pushed when it first jumps back and popped once it's done...
+inline void stepper::trackLoop(stepperData *sd, int loopEnd, bool looping)
+{
+    if (sd->loopDepth > JOURNAL_MAX_LOOPS)
+        return;
+    bool onTop = (sd->loopDepth > 0 && sd->loopStack[sd->loopDepth - 1] == loopEnd);
+    if (looping && !onTop) {
+        if (sd->loopDepth < JOURNAL_MAX_LOOPS)
+            sd->loopStack[sd->loopDepth] = loopEnd;
+        sd->loopDepth++;
+    }
+    else if (!looping && onTop)
+        sd->loopDepth--;
+}
+
+// Get a consistent copy of the machine state, safe to call from any number of threads...
+void stepper::getMachineState(machineState *state)
+{
+    unsigned int seq;
+    state->time = 0;
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+        axisGroup *grp = &groups[g];
+        long long int groupTime;
+        do {
+            // Wait out any update in progress...
+            while ((seq = grp->stateSeq) & 1)
+                sched_yield();
+            __sync_synchronize();
+            groupTime = grp->stateTime;
+            for (int gm = 0; gm < grp->numMotors; gm++)
+                state->motor[grp->motors[gm]] = publishedState.motor[grp->motors[gm]];
+            __sync_synchronize();
+        } while (seq != grp->stateSeq);
+        if (groupTime > state->time) state->time = groupTime;
+    }
+    // Fill in the derived values outside of the seqlock...
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        motorState *ms = &state->motor[n];
+        ms->positionMM = (double)ms->position / (double)stepData[n].axis.stepsPerMM;
+        if (ms->stepInterval > 0)
+            ms->velocity = ms->dir * cycleFreq / ms->stepInterval;
+        else
+            ms->velocity = 0.0;
+    }
+}
+
+// Turn a "move to" command into a relative move from the current position.
+// Returns false if we're already there...
+bool stepper::resolveMoveTo(int motorNum, stepperCmd *cmd)
+{
+    return(planResolveMoveTo(&stepData[motorNum].axis, cycleFreq, cmd, stepData[motorNum].position));
+}
+
+// True if none of a group's motors has queued commands left to run
+// (and, for group 0 which runs them, there are no priority commands)...
+bool stepper::stepperIdle(axisGroup *grp)
+{
+    if (grp->groupNum == 0 && !priorityCmdList.isEmpty())
+        return(false);
+    for (int gm = 0; gm < grp->numMotors; gm++) {
+        int n = grp->motors[gm];
+        if (stepData[n].stepping && (stepData[n].currQueuedCmd < stepData[n].numQueuedCmds || stepData[n].nextProgram)
+                && !(holdRequested && stepData[n].holdState == HOLD_STOPPED))
+            return(false);
+    }
+    return(true);
+}
+
+// Block a group's step thread until there's work to do or we're told to shut down.
+// Everyone who gives us work changes state first, then calls wakeStepperThread()
+// so checking again under the lock means a wakeup can't be missed...
+void stepper::waitWhileIdle(axisGroup *grp)
+{
+    // Make sure the snapshot shows where we stopped...
+    publishState(grp);
+    pthread_mutex_lock(&idleLock);
+    grp->sleeping = true;
+    while (!pthreadStatus && stepperIdle(grp))
+        pthread_cond_wait(&idleCond, &idleLock);
+    grp->sleeping = false;
+    pthread_mutex_unlock(&idleLock);
+}
+
+// Wake any step threads waiting for work, they'll each check if it's for them...
+void stepper::wakeStepperThread(void)
+{
+    pthread_mutex_lock(&idleLock);
+    pthread_cond_broadcast(&idleCond);
+    pthread_mutex_unlock(&idleLock);
+}
+
+// Wait for a motor's step thread to finish any tick that could have started before the
+// caller stopped the motor, so nothing we change next can be half way through being used.
+// No wait at all if the thread's asleep with nothing to do (or there isn't one)...
+void stepper::waitForTick(int motorNum)
+{
+    axisGroup *grp = &groups[motorGroups[motorNum]];
+    struct timespec delay = {0, (long)cyclePeriod};
+    __sync_synchronize();
+    unsigned int seq = grp->tickSeq;
+    while (grp->started && !pthreadStatus && grp->tickSeq == seq) {
+        // Checked under the lock, it wakes up holding it so it'll see what we changed...
+        pthread_mutex_lock(&idleLock);
+        bool sleeping = grp->sleeping;
+        pthread_mutex_unlock(&idleLock);
+        if (sleeping)
+            break;
+        nanosleep(&delay, NULL);
+    }
+}
+
+// Pin a group's thread to its core, if the board has that many...
+void stepper::pinToCpu(axisGroup *grp)
+{
+    if (grp->cpu < 0 || grp->cpu >= sysconf(_SC_NPROCESSORS_ONLN))
+        return;
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(grp->cpu, &cpus);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus))
+        rtLog(LOG_WARN, "Failed to pin axis group %d to cpu %d", grp->groupNum, grp->cpu);
+}
+
+// Record a tick's timings in its group's profile - called from the group's thread only...
+inline void stepper::profileTick(axisGroup *grp, int profiling, long long int deadline, long long int wakeTime,
+                                 long long int pulseStart, long long int pulseEnd, long long int tickEnd)
+{
+    stepProfile *prof = &grp->profile;
+    if (profiling & PROFILE_HISTOGRAMS) {
+        prof->wake.record(wakeTime - deadline);
+        prof->tick.record(tickEnd - wakeTime);
+        if (pulseEnd != pulseStart)
+            prof->pulse.record(pulseEnd - pulseStart);
+    }
+    if ((profiling & PROFILE_TRACE) && prof->trace && prof->traceCount + NUM_PHASES <= PROFILE_TRACE_SIZE) {
+        long long int edges[NUM_PHASES + 1] = {deadline, wakeTime, pulseStart, pulseEnd, tickEnd};
+        phaseEvent *event = &prof->trace[prof->traceCount];
+        int numEvents = 0;
+        for (int ph = 0; ph < NUM_PHASES; ph++) {
+            if (edges[ph + 1] <= edges[ph])
+                continue;
+            event->start = edges[ph];
+            event->duration = (int)(edges[ph + 1] - edges[ph]);
+            event->phase = ph;
+            event->groupNum = grp->groupNum;
+            event++;
+            numEvents++;
+        }
+        // Events before the count, see writeProfileTrace()...
+        __sync_synchronize();
+        prof->traceCount += numEvents;
+    }
+}
+
+// The first cycle boundary at or after time t (nS), so every group stays on the same cycle grid...
+long long int stepper::nextCycleAfter(long long int t)
+{
+    if (t <= cycleEpoch)
+        return(cycleEpoch);
+    return(cycleEpoch + ((t - cycleEpoch + cyclePeriod - 1) / cyclePeriod) * cyclePeriod);
+}
+
+// Static(!?) method used to start the 'real' stepper motor thread for an axis group...
+void * stepper::stepperThread1(void *p_grp)
+{
+    axisGroup *grp = (axisGroup *)p_grp;
+    grp->owner->stepperThread(grp);
+    return(NULL);
+}
+
+// 'Real' stepper motor thread that loops forever and drives an axis group's stepper motors...
+void stepper::stepperThread(axisGroup *grp)
 {
-    struct timespec tim2;
     long long int llSysTime_prev, llSysTime_curr;
     long long int t1, t2;
     llSysTime_prev = getSysTime();
@@ -174,42 +534,123 @@ void stepper::stepperThread()
     long int sum;
     stepperCmd *currCmd;
     int currQueuedCmd, numQueuedCmds;
+    stepperCmd **cmdTable;
     int stepPins[NUM_MOTORS], dirPins[NUM_MOTORS], dirs[NUM_MOTORS];
     bool motorEnable[NUM_MOTORS];
     int num2step;
+    bool dirChanged;
+    int msChanges[NUM_MOTORS], numMsChanges;
+    int profiling;
+    bool holding;
+    long long int lateness, wakeTime, pulseStart = 0, pulseEnd = 0;
+    // Wait for the other groups to be started, then all start together at the epoch...
+    pinToCpu(grp);
+    pthread_mutex_lock(&idleLock);
+    while (!groupsReleased)
+        pthread_cond_wait(&idleCond, &idleLock);
+    pthread_mutex_unlock(&idleLock);
+    long long int nextCycle = cycleEpoch;
+    lateness = grp->cycleTimer.waitUntil(nextCycle);
+    wakeTime = nextCycle + lateness;
     while (!pthreadStatus) {
+        // Profiling costs a flag check per tick when it's off...
+        profiling = profileFlags;
+        holding = holdRequested;
+        if (profiling && grp->profile.generation != profileGen) {
+            grp->profile.wake.reset();
+            grp->profile.tick.reset();
+            grp->profile.pulse.reset();
+            grp->profile.traceCount = 0;
+            grp->profile.generation = profileGen;
+        }
         //
-        // Process any priority commands...
-        while (!priorityCmdList.isEmpty()) {
+        // Process any priority commands (group 0 looks after those)...
+        while (grp->groupNum == 0 && !priorityCmdList.isEmpty()) {
             pthread_mutex_lock(&pc_lock);
             currCmd = priorityCmdList.takeFirst();
             pthread_mutex_unlock(&pc_lock);
             if (currCmd->cmdType == STEPCMD_CHECK_LOOP_FREQ) {
                 t1 = getSysTime();
                 for (int ncs = 0; ncs < currCmd->cycleCounter; ncs++) {
-                    nanosleep(&cycleDelay, &tim2);
+                    nextCycle += cyclePeriod;
+                    grp->cycleTimer.waitUntil(nextCycle);
                 }
                 t2 = getSysTime();
                 cycleFreq = 1000000.0 / (((double)t2 - (double)t1) / (double)currCmd->cycleCounter);
-                printf("cycleFreq (Hz) %f\n", cycleFreq);
+                rtLog(LOG_INFO, "cycleFreq (Hz) %f, wake margin (nS) %lld", cycleFreq, grp->cycleTimer.getMargin());
             }
             delete currCmd;
         }
         //
         // Step through the motor's command queues to see if we need to do anything...
         num2step = 0;
-        for (motorNum = 0; motorNum < NUM_MOTORS; motorNum++) {
+        dirChanged = false;
+        numMsChanges = 0;
+        for (int gm = 0; gm < grp->numMotors; gm++) {
+            motorNum = grp->motors[gm];
             motorEnable[motorNum] = false;
             if (!stepData[motorNum].stepping) continue;
-            numQueuedCmds = stepData[motorNum].queuedCmdList.size();
+            // Armed for a synchronised start?  Hold the motor (enabled) until its cycle comes round...
+            if (stepData[motorNum].startTime) {
+                if (nextCycle < stepData[motorNum].startTime) {
+                    motorEnable[motorNum] = true;
+                    continue;
+                }
+                if (nextCycle != stepData[motorNum].startTime)
+                    rtLog(LOG_WARN, "Motor %d started %lld nS late", motorNum + 1, nextCycle - stepData[motorNum].startTime);
+                stepData[motorNum].startTime = 0;
+            }
+            // Carry straight on with the next program once this one's done...
+            if (stepData[motorNum].nextProgram && stepData[motorNum].currQueuedCmd >= stepData[motorNum].numQueuedCmds) {
+                if (swapProgram(motorNum) < 0) {
+                    motorEnable[motorNum] = true;
+                    continue;
+                }
+            }
+            // Read the count before the table, see publishCmds()...
+            numQueuedCmds = stepData[motorNum].numQueuedCmds;
+            __sync_synchronize();
+            cmdTable = stepData[motorNum].cmdTable;
             currQueuedCmd = stepData[motorNum].currQueuedCmd;
             if (numQueuedCmds && currQueuedCmd < numQueuedCmds) {
                 motorEnable[motorNum] = true;
-                // Ignore all loop start commands...
-                currCmd = stepData[motorNum].queuedCmdList[currQueuedCmd];
-                while (currCmd->cmdType == STEPCMD_LOOP_START) {
-                    currQueuedCmd = ++stepData[motorNum].currQueuedCmd;
-                    currCmd = stepData[motorNum].queuedCmdList[currQueuedCmd];
+                grp->checkpointDue = true;
+                // Ignore all loop start commands, and sync points with no next program to swap in...
+                currCmd = cmdTable[currQueuedCmd];
+                while (currCmd->cmdType == STEPCMD_LOOP_START || currCmd->cmdType == STEPCMD_SYNC) {
+                    int swapped = (currCmd->cmdType == STEPCMD_SYNC)?swapProgram(motorNum):0;
+                    if (swapped < 0)
+                        break;
+                    if (swapped) {
+                        numQueuedCmds = stepData[motorNum].numQueuedCmds;
+                        cmdTable = stepData[motorNum].cmdTable;
+                        currQueuedCmd = 0;
+                    }
+                    else
+                        currQueuedCmd = ++stepData[motorNum].currQueuedCmd;
+                    if (currQueuedCmd >= numQueuedCmds)
+                        break;
+                    currCmd = cmdTable[currQueuedCmd];
+                }
+                // Ran off the end, or have to wait at a sync point for another cycle...
+                if (currQueuedCmd >= numQueuedCmds || currCmd->cmdType == STEPCMD_SYNC)
+                    continue;
+                // Feed hold: a move under way slows down to a stop, anything else waits where it is.
+                // Once the hold's released a stopped move ramps up again from where it stopped...
+                if (holding) {
+                    if (stepData[motorNum].holdState == HOLD_NONE) {
+                        if (planMoveUnderWay(currCmd) && planHold(currCmd, stepData[motorNum].stepSize))
+                            stepData[motorNum].holdState = HOLD_SLOWING;
+                        else
+                            stepData[motorNum].holdState = HOLD_STOPPED;
+                    }
+                    if (stepData[motorNum].holdState == HOLD_STOPPED)
+                        continue;
+                }
+                else if (stepData[motorNum].holdState != HOLD_NONE) {
+                    if (planMoveUnderWay(currCmd))
+                        planResume(currCmd, stepData[motorNum].stepSize, stepData[motorNum].holdState == HOLD_STOPPED);
+                    stepData[motorNum].holdState = HOLD_NONE;
                 }
                 // If this is the first time we're seeing the 'pause' command
                 // Then disable the stepper...
@@ -217,6 +658,14 @@ void stepper::stepperThread()
                     setStepperEnable(motorNum, false);
                     currCmd->dir = 1;
                 }
+                // If this is the first time we're seeing a "move to" command
+                // Then work out how far we have to go from where we are now...
+                if (currCmd->cmdType == STEPCMD_MOVE_TO && currCmd->dir == 0) {
+                    if (!resolveMoveTo(motorNum, currCmd)) {
+                        stepData[motorNum].currQueuedCmd++;
+                        continue;
+                    }
+                }
                 // If the command being processed for the current motor doesn't trigger this cycle
                 // Then loop back to check the next motor's command queue...
                 if (--currCmd->cycleCounter) {
@@ -225,28 +674,27 @@ void stepper::stepperThread()
                 --currCmd->triggerCounter;
                 //
                 // Process a "move" command trigger event...
-                if (currCmd->cmdType == STEPCMD_MOVE){
-                    // Set up to step the curent motor...
-                    stepPins[num2step] = stepData[motorNum].stepPin;
-                    dirPins[num2step] = stepData[motorNum].dirPin;
+                if (currCmd->cmdType == STEPCMD_MOVE || currCmd->cmdType == STEPCMD_MOVE_TO) {
+                    stepperData *sd = &stepData[motorNum];
+                    // Set up to step the curent motor.
+                    // Triggers and positions are always in fine steps, a coarse step is stepSize of them...
+                    stepPins[num2step] = sd->stepPin;
+                    dirPins[num2step] = sd->dirPin;
                     dirs[num2step] = (currCmd->dir < 0)?LOW:HIGH;
-                    num2step++;
-                    // If there are more triggers in the "move" command
-                    // Then set things up for the next iteration
-                    // Else move on to the next command in the queue...
-                    if (currCmd->triggerCounter) {
-                        float  cim1 = (float)(currCmd->numCycles);
-                        float ni = (float)(currCmd->numTriggers - currCmd->triggerCounter) + 1.0;
-                        long int ci = (int)(cim1 - 2.0 * cim1 / (4.0 * ni));
-                        currCmd->numCycles = (ci < currCmd->endNumCycles)?currCmd->endNumCycles:ci;
-                        currCmd->cycleCounter = currCmd->numCycles;
+                    if (sd->dirLevel != dirs[num2step]) {
+                        sd->dirLevel = dirs[num2step];
+                        dirChanged = true;
                     }
-                    else {
-                        currCmd->numCycles = currCmd->initNumCycles;
-                        currCmd->cycleCounter = 1;
-                        currCmd->triggerCounter = currCmd->numTriggers;
+                    num2step++;
+                    // Take the step and work out when the next one's due (stepplan.h)...
+                    int planned = planStep(&sd->axis, currCmd, &sd->stepSize, &sd->position);
+                    if (planned & PLAN_MS_CHANGE)
+                        msChanges[numMsChanges++] = motorNum;
+                    if (planned & PLAN_MOVE_DONE)
                         stepData[motorNum].currQueuedCmd++;
-                    }
+                    // Stopped, or ran out of move before we'd finished slowing down...
+                    if ((planned & PLAN_HELD) || ((planned & PLAN_MOVE_DONE) && sd->holdState == HOLD_SLOWING))
+                        sd->holdState = HOLD_STOPPED;
                 }
                 //
                 // Process a "pause" command trigger event...
@@ -271,10 +719,12 @@ void stepper::stepperThread()
                         if (currCmd->triggerCounter < 0) {
                             currCmd->triggerCounter = 0;
                         }
+                        trackLoop(&stepData[motorNum], stepData[motorNum].currQueuedCmd, true);
                         stepData[motorNum].currQueuedCmd = currCmd->dir;
                     }
                     else {
                         currCmd->triggerCounter = currCmd->numTriggers;
+                        trackLoop(&stepData[motorNum], stepData[motorNum].currQueuedCmd, false);
                         stepData[motorNum].currQueuedCmd++;
                     }
                 }
@@ -282,67 +732,134 @@ void stepper::stepperThread()
         }
         //
         // Drive the motors that needed to be driven...
+        if (profiling) pulseStart = precisionTimer::now();
         if (num2step > 0) {
+            // A direction change has to reach the driver and settle before the step edge...
+            if (dirChanged) {
+                for (int cs = 0; cs < num2step; cs++)
+                    gpioWrite(dirPins[cs], dirs[cs]);
+                gpioCommit();
+                long long int dirSet = precisionTimer::now();
+                while (precisionTimer::now() - dirSet < DIR_SETUP_NS)
+                    ;
+            }
             for (int cs = 0; cs < num2step; cs++) {
-                digitalWrite (dirPins[cs], dirs[cs]);
-                digitalWrite (stepPins[cs], HIGH);
+                gpioWrite(stepPins[cs], HIGH);
             }
+            gpioCommit();
             for (int dd = 0; dd < PULSE_WIDTH_DELAY; dd++) sum++;
             for (int cs = 0; cs < num2step; cs++) {
-                digitalWrite (stepPins[cs], LOW);
+                gpioWrite(stepPins[cs], LOW);
             }
+            gpioCommit();
+        }
+        if (profiling) pulseEnd = (num2step > 0)?precisionTimer::now():pulseStart;
+        // Change microstep modes only after this cycle's steps are done...
+        if (numMsChanges > 0) {
+            for (int mc = 0; mc < numMsChanges; mc++)
+                setMicrostep(msChanges[mc], stepData[msChanges[mc]].stepSize);
+            gpioCommit();
         }
         // Turn off any motors that we're done with...
-        for (int n = 0; n < NUM_MOTORS; n++) {
+        for (int gm = 0; gm < grp->numMotors; gm++) {
+            int n = grp->motors[gm];
             if (!motorEnable[n]) {
                 setStepperEnable(n, motorEnable[n]);
             }
         }
-        // Wait a bit, then loop back to do it all over again...
-        nanosleep(&cycleDelay, &tim2);
+        // Every so often let the GUI know where we are...
+        if (--grp->telemetryCountdown == 0) {
+            grp->telemetryCountdown = TELEMETRY_DECIMATE;
+            publishTelemetry(grp);
+            publishState(grp);
+        }
+        // Checkpoint progress every so often, on the same cycles in every group...
+        long int checkpointCycles = journalCycles;
+        if (checkpointCycles && grp->checkpointDue && ((nextCycle - cycleEpoch) / cyclePeriod) % checkpointCycles == 0)
+            checkpoint(grp, (nextCycle - cycleEpoch) / cyclePeriod);
+        if (profiling)
+            profileTick(grp, profiling, wakeTime - lateness, wakeTime, pulseStart, pulseEnd, precisionTimer::now());
+        // If no motor has anything left to do, sleep until someone gives us work...
+        if (num2step == 0 && stepperIdle(grp)) {
+            if (journalCycles && grp->checkpointDue)
+                checkpoint(grp, (nextCycle - cycleEpoch) / cyclePeriod);
+            waitWhileIdle(grp);
+            nextCycle = nextCycleAfter(precisionTimer::now());
+            lateness = grp->cycleTimer.waitUntil(nextCycle);
+            wakeTime = nextCycle + lateness;
+            continue;
+        }
+        // That's everything this tick will do with the motors...
+        __sync_synchronize();
+        grp->tickSeq++;
+        // Wait for the start of the next cycle, then loop back to do it all over again.
+        // If we've fallen hopelessly behind skip ahead to the next cycle on the common grid...
+        nextCycle += cyclePeriod;
+        lateness = grp->cycleTimer.waitUntil(nextCycle);
+        wakeTime = nextCycle + lateness;
+        if (lateness > CYCLE_RESYNC_NS)
+            nextCycle = nextCycleAfter(wakeTime) - cyclePeriod;
     }
-pthreadStatus = 2;
 }
 
 // Start processing the commands queued for a stepper motor...
 void stepper::startMotor(int motorNum)
 {
+    controlGuard guard(&controlLock);
     if (motorNum < 0 || motorNum >= NUM_MOTORS)
       return;
     setStepperEnable(motorNum, true);
+    journal.runStarted();
+    stepData[motorNum].startTime = 0;
     stepData[motorNum].stepping = true;
+    wakeStepperThread();
 }
 
-// Stop processing the commands queued for a stepper motor...
+// Stop processing the commands queued for a stepper motor.
+// Once this returns the step thread has let go of the motor's commands.  The driver's
+// put back to fine steps, and a move that was cut off will ramp up again from a
+// standstill, since whatever comes next expects to start at full resolution...
 void stepper::stopMotor(int motorNum)
 {
+    controlGuard guard(&controlLock);
     if (motorNum < 0 || motorNum >= NUM_MOTORS)
       return;
-    stepData[motorNum].stepping = false;
+    stepperData *sd = &stepData[motorNum];
+    sd->stepping = false;
+    waitForTick(motorNum);
+    int currQueuedCmd = sd->currQueuedCmd;
+    if (currQueuedCmd < sd->numQueuedCmds && planMoveUnderWay(sd->cmdTable[currQueuedCmd]))
+        planResume(sd->cmdTable[currQueuedCmd], 1, true);
+    sd->stepSize = 1;
+    setMicrostep(motorNum, 1);
+    gpioCommit();
     setStepperEnable(motorNum, false);
 }
 
 // Stop processing the commands queued for a stepper motor and reset the queue...
 void stepper::resetMotor(int motorNum)
 {
+    controlGuard guard(&controlLock);
     if (motorNum < 0 || motorNum >= NUM_MOTORS)
       return;
-    stepData[motorNum].stepping = false;
+    stopMotor(motorNum);
     stepData[motorNum].currQueuedCmd = 0;
-    setStepperEnable(motorNum, false);
+    stepData[motorNum].loopDepth = 0;
+    stepData[motorNum].holdState = HOLD_NONE;
 }
 
 // Stop processing the commands queued for a stepper motor and delete all commands...
 void stepper::clearMotor(int motorNum)
 {
+    controlGuard guard(&controlLock);
     if (motorNum < 0 || motorNum >= NUM_MOTORS)
       return;
-    stepData[motorNum].stepping = false;
+    stopMotor(motorNum);
     // Clear all commands queued for the motor...
-    while (!stepData[motorNum].queuedCmdList.isEmpty())
-        delete stepData[motorNum].queuedCmdList.takeFirst();
+    freeCmds(motorNum);
     stepData[motorNum].currQueuedCmd = 0;
-    setStepperEnable(motorNum, false);
+    stepData[motorNum].loopDepth = 0;
+    stepData[motorNum].holdState = HOLD_NONE;
 }
 
 
@@ -371,16 +888,42 @@ long long int *stepper::getStepperLog(int motorNum)
     return(NULL);
 }
 
-// Start everything...
+// Start everything together...
 void stepper::startAll()
 {
+    controlGuard guard(&controlLock);
+    bool motors[NUM_MOTORS];
     for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
-        startMotor(motorNum);
+        motors[motorNum] = true;
+    startSynced(motors);
+}
+
+// Start a set of motors on the same step thread cycle.
+// The drivers are all enabled together (one enable delay, not one each), then every
+// motor is armed to start on the same future cycle of the common grid so the groups'
+// threads begin their first step in the same tick.  Returns the start time (nS)...
+long long int stepper::startSynced(const bool motors[NUM_MOTORS])
+{
+    controlGuard guard(&controlLock);
+    enableSteppers(motors);
+    journal.runStarted();
+    long long int startTime = nextCycleAfter(precisionTimer::now() + SYNC_START_LEAD_NS);
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
+        if (motors[motorNum])
+            stepData[motorNum].startTime = startTime;
+    // Arm before letting the step threads see the motors...
+    __sync_synchronize();
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
+        if (motors[motorNum])
+            stepData[motorNum].stepping = true;
+    wakeStepperThread();
+    return(startTime);
 }
 
 // Stop everything......
 void stepper::stopAll()
 {
+    controlGuard guard(&controlLock);
     for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
         stopMotor(motorNum);
 }
@@ -388,67 +931,134 @@ void stepper::stopAll()
 // Stop and reset all motion...
 void stepper::resetAll()
 {
+    controlGuard guard(&controlLock);
+    holdRequested = false;
     for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
         resetMotor(motorNum);
+    journal.invalidate();
 }
 
 // Clear everything...
 void stepper::clearAll()
 {
+    controlGuard guard(&controlLock);
+    holdRequested = false;
     for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
         clearMotor(motorNum);
+    journal.invalidate();
 }
 
-// Queue a move command for a motor...
-int stepper::queueMoveCmd(int motorNum, double distance, double duration, double accel)
+// Feed hold: every move under way slows down to a stop as hard as its acceleration
+// allows, and nothing new starts.  Motors stay enabled and where they stopped is
+// kept exactly, so feedResume() carries on from there...
+void stepper::feedHold()
 {
-    if (motorNum < 0 || motorNum >= NUM_MOTORS)
-        return(-1);
-    // Create a move command...
-    stepperCmd *newMove = new stepperCmd;
-    newMove->cmdType = STEPCMD_MOVE;
-    double adistance = fabs(distance);
-    newMove->numTriggers = (long int)(adistance * stepData[motorNum].stepsPerMM);
-    newMove->triggerCounter = newMove->numTriggers;
-    double triggersPerSec = (adistance / duration) * (double)(stepData[motorNum].stepsPerMM);
-    long int endNumCycles = (long int)(cycleFreq / triggersPerSec);
-    endNumCycles = (endNumCycles < stepData[motorNum].minCyclesPerStep)?stepData[motorNum].minCyclesPerStep:endNumCycles;
-    long int initNumCycles = (long int)(200.0 / accel);
-    if (initNumCycles < endNumCycles) initNumCycles = endNumCycles;
-    newMove->numCycles = initNumCycles;
-    newMove->cycleCounter = 1;
-    newMove->initNumCycles = initNumCycles;
-    newMove->endNumCycles = endNumCycles;
-    newMove->dir = (distance < 0)?-1:1;
-    dumpCmd("ADDING Move", newMove);
-    // Add the move command to the thread's list...
-    pthread_mutex_lock(&stepData[motorNum].lock);
-    stepData[motorNum].queuedCmdList.append(newMove);
-    pthread_mutex_unlock(&stepData[motorNum].lock);
-    return(0);
+    controlGuard guard(&controlLock);
+    holdRequested = true;
 }
 
-// Queue a pause command for a motor...
-int stepper::queuePauseCmd(int motorNum, double duration)
+// Let go of a feed hold, held moves ramp back up and carry on...
+void stepper::feedResume()
 {
-    if (motorNum < 0 || motorNum >= NUM_MOTORS)
+    controlGuard guard(&controlLock);
+    holdRequested = false;
+    wakeStepperThread();
+}
+
+// True once a feed hold has brought every motor with work left to a stop...
+bool stepper::isHeld()
+{
+    if (!holdRequested)
+        return(false);
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++) {
+        stepperData *sd = &stepData[motorNum];
+        if (sd->stepping && sd->currQueuedCmd < sd->numQueuedCmds && sd->holdState != HOLD_STOPPED)
+            return(false);
+    }
+    return(true);
+}
+
+// How often (mS) the step threads checkpoint their progress, 0 to stop...
+void stepper::setJournalInterval(int ms)
+{
+    controlGuard guard(&controlLock);
+    if (!journal.isOpen() || ms <= 0) {
+        journalCycles = 0;
+        return;
+    }
+    long int cycles = (long int)(((long long int)ms * 1000000LL) / cyclePeriod);
+    journalCycles = (cycles < 1)?1:cycles;
+}
+
+// True if the journal says the last run stopped part way through programs we've still got...
+bool stepper::canResume()
+{
+    controlGuard guard(&controlLock);
+    journalMotor saved[NUM_MOTORS];
+    if (!journal.recover(saved))
+        return(false);
+    bool unfinished = false;
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (saved[n].currQueuedCmd >= saved[n].numQueuedCmds)
+            continue;
+        if (!saved[n].programHash || saved[n].numLoops < 0)
+            return(false);
+        unfinished = true;
+    }
+    return(unfinished);
+}
+
+// Put everything back where the journal says the last run got to: positions, programs,
+// the command each motor was on, loop counters and how much of a move was left.
+// A move cut off part way ramps up again from a standstill.  Start the motors to
+// carry on, returns < 0 if the run can't be picked up...
+int stepper::resumeFromJournal()
+{
+    controlGuard guard(&controlLock);
+    journalMotor saved[NUM_MOTORS];
+    QVector<stepperProgramCmd> programs[NUM_MOTORS];
+    if (!canResume() || !journal.recover(saved))
         return(-1);
-    // Create a pause command...
-    stepperCmd *newPause = new stepperCmd;
-    newPause->cmdType = STEPCMD_PAUSE;
-    newPause->numTriggers = 1;
-    newPause->triggerCounter = 1;
-    long int numCycles = (long int)(cycleFreq * duration) - 1;
-    newPause->numCycles = numCycles;
-    newPause->cycleCounter = numCycles;
-    newPause->initNumCycles = numCycles;
-    newPause->endNumCycles = 0;
-    newPause->dir = 0;
-    dumpCmd("ADDING Pause", newPause);
-    // Add the pause command to the thread's list...
-    pthread_mutex_lock(&stepData[motorNum].lock);
-    stepData[motorNum].queuedCmdList.append(newPause);
-    pthread_mutex_unlock(&stepData[motorNum].lock);
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (saved[n].currQueuedCmd < saved[n].numQueuedCmds && !journal.readProgram(n, saved[n].programHash, programs[n])) {
+            rtLog(LOG_ERROR, "Motor %d's program isn't with the journal any more", n + 1);
+            return(-1);
+        }
+    }
+    clearAll();
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        stepperData *sd = &stepData[n];
+        const journalMotor *jm = &saved[n];
+        sd->position = jm->position;
+        if (jm->currQueuedCmd >= jm->numQueuedCmds)
+            continue;
+        if (loadProgram(n, programs[n].constData(), programs[n].size()) < 0 || sd->numQueuedCmds != jm->numQueuedCmds) {
+            rtLog(LOG_ERROR, "Motor %d's program doesn't match the journal", n + 1);
+            clearAll();
+            return(-1);
+        }
+        for (int l = 0; l < jm->numLoops; l++) {
+            if (jm->loopCmd[l] < 0 || jm->loopCmd[l] >= sd->numQueuedCmds || sd->cmdTable[jm->loopCmd[l]]->cmdType != STEPCMD_LOOP_STOP) {
+                clearAll();
+                return(-1);
+            }
+            sd->cmdTable[jm->loopCmd[l]]->triggerCounter = jm->loopCounter[l];
+            sd->loopStack[l] = jm->loopCmd[l];
+        }
+        sd->loopDepth = jm->numLoops;
+        // Finish off a move that was under way, a "move to" is worked out again from where it started...
+        stepperCmd *cmd = sd->cmdTable[jm->currQueuedCmd];
+        if (jm->moveLeft > 0 && (cmd->cmdType == STEPCMD_MOVE || cmd->cmdType == STEPCMD_MOVE_TO)) {
+            if (cmd->cmdType == STEPCMD_MOVE_TO)
+                planResolveMoveTo(&sd->axis, cycleFreq, cmd, cmd->targetPos - jm->moveDir * jm->moveTriggers);
+            cmd->triggerCounter = jm->moveLeft;
+            planResume(cmd, 1, true);
+        }
+        sd->currQueuedCmd = jm->currQueuedCmd;
+        rtLog(LOG_INFO, "Motor %d picks up at command %d/%d, position %lld", n + 1,
+              jm->currQueuedCmd, jm->numQueuedCmds, jm->position);
+    }
+    journal.forget();
     return(0);
 }
 
@@ -460,18 +1070,69 @@ void stepper::setStepperEnable(int motorNum, bool enabled)
     if (enabled == stepData[motorNum].enabled)
         return;
     if (enabled) {
-        digitalWrite (stepData[motorNum].enablePin, LOW);
+        gpioWrite(stepData[motorNum].enablePin, LOW);
+        gpioCommit();
         nanosleep(&enableDelay, &tim2);
     }
     else {
-        digitalWrite (stepData[motorNum].enablePin, HIGH);
+        gpioWrite(stepData[motorNum].enablePin, HIGH);
+        gpioCommit();
     }
     stepData[motorNum].enabled = enabled;
 }
 
-void stepper::queueLoopStartCmd(int motorNum)
+// Enable a set of motors' drivers at once, waiting for them to settle just the once...
+void stepper::enableSteppers(const bool motors[NUM_MOTORS])
+{
+    struct timespec tim2;
+    bool changed = false;
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++) {
+        if (!motors[motorNum] || stepData[motorNum].enabled)
+            continue;
+        gpioWrite(stepData[motorNum].enablePin, LOW);
+        changed = true;
+    }
+    if (!changed)
+        return;
+    gpioCommit();
+    nanosleep(&enableDelay, &tim2);
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
+        if (motors[motorNum])
+            stepData[motorNum].enabled = true;
+}
+
+// Drive a motor's microstep select pins for fine (stepSize 1) or coarse steps...
+void stepper::setMicrostep(int motorNum, int stepSize)
+{
+    const int *levels = (stepSize > 1)?msCoarseLevels:msFineLevels;
+    for (int ms = 0; ms < 3; ms++) {
+        if (stepData[motorNum].msPins[ms] >= 0)
+            gpioWrite(stepData[motorNum].msPins[ms], levels[ms]);
+    }
+}
+
+// Fill in a move command for a motor...
+void stepper::convertMove(int motorNum, stepperCmd *newMove, double distance, double duration, double accel)
+{
+    planMove(&stepData[motorNum].axis, cycleFreq, newMove, distance, duration, accel);
+}
+
+// Fill in a move to an absolute position (mm) for a motor,
+// the distance is worked out when the step thread gets to it...
+void stepper::convertMoveTo(int motorNum, stepperCmd *newMove, double position, double duration, double accel)
+{
+    planMoveTo(&stepData[motorNum].axis, newMove, position, duration, accel);
+}
+
+// Fill in a pause command...
+void stepper::convertPause(stepperCmd *newPause, double duration)
+{
+    planPause(cycleFreq, newPause, duration);
+}
+
+// Fill in a loop start command...
+void stepper::convertLoopStart(stepperCmd *newCmd)
 {
-    stepperCmd *newCmd = new stepperCmd;
     newCmd->cmdType = STEPCMD_LOOP_START;
     newCmd->numTriggers = 0;
     newCmd->triggerCounter = 0;
@@ -480,16 +1141,23 @@ void stepper::queueLoopStartCmd(int motorNum)
     newCmd->initNumCycles = 0;
     newCmd->endNumCycles = 0;
     newCmd->dir = 0;
-    // Add the command to the thread's list...
-    pthread_mutex_lock(&stepData[motorNum].lock);
-    stepData[motorNum].queuedCmdList.append(newCmd);
-    pthread_mutex_unlock(&stepData[motorNum].lock);
-    dumpCmd("ADDING loop start", newCmd);
+    newCmd->targetPos = 0;
+    newCmd->duration = 0.0;
+    newCmd->rampStart = 0;
+    newCmd->decelSteps = 0;
+    newCmd->cyclesLeft = 0;
 }
 
-void stepper::queueLoopEndCmd(int motorNum, int startLoopIndex, int cycleCounter)
+// Fill in a sync point...
+void stepper::convertSync(stepperCmd *newCmd)
+{
+    convertLoopStart(newCmd);
+    newCmd->cmdType = STEPCMD_SYNC;
+}
+
+// Fill in a loop end command that jumps back to startLoopIndex in the queue...
+void stepper::convertLoopEnd(stepperCmd *newCmd, int startLoopIndex, int cycleCounter)
 {
-    stepperCmd *newCmd = new stepperCmd;
     newCmd->cmdType = STEPCMD_LOOP_STOP;
     newCmd->numTriggers = cycleCounter;
     newCmd->triggerCounter = cycleCounter;
@@ -498,22 +1166,568 @@ void stepper::queueLoopEndCmd(int motorNum, int startLoopIndex, int cycleCounter
     newCmd->initNumCycles = 1;
     newCmd->endNumCycles = 1;
     newCmd->dir = startLoopIndex;
-    // Add the command to the thread's list...
-    pthread_mutex_lock(&stepData[motorNum].lock);
-    stepData[motorNum].queuedCmdList.append(newCmd);
-    pthread_mutex_unlock(&stepData[motorNum].lock);
+    newCmd->targetPos = 0;
+    newCmd->duration = 0.0;
+    newCmd->rampStart = 0;
+    newCmd->decelSteps = 0;
+    newCmd->cyclesLeft = 0;
+}
+
+// Hand a block of converted commands to the step thread.
+// The new commands are written into the motor's command table (moving to a bigger
+// table if needed) and only then is the count the step thread looks at bumped, so
+// it sees either none or all of them.  Outgrown tables are kept until clearMotor()
+// since the step thread may still be reading one.  If relocate is set the block's
+// loop ends jump to indexes within the block, they're moved to where it lands while
+// we hold the lock so nobody else's commands can get in first...
+void stepper::publishCmds(int motorNum, stepperCmd *block, int numCmds, bool relocate)
+{
+    stepperData *sd = &stepData[motorNum];
+    pthread_mutex_lock(&sd->lock);
+    reapProgram(sd);
+    int numQueued = sd->numQueuedCmds;
+    if (relocate) {
+        for (int c = 0; c < numCmds; c++)
+            if (block[c].cmdType == STEPCMD_LOOP_STOP)
+                block[c].dir += numQueued;
+    }
+    if (numQueued + numCmds > sd->cmdTableSize) {
+        int newSize = (sd->cmdTableSize > 0)?sd->cmdTableSize:CMD_TABLE_INIT_SIZE;
+        while (newSize < numQueued + numCmds) newSize *= 2;
+        stepperCmd **newTable = new stepperCmd *[newSize];
+        for (int c = 0; c < numQueued; c++)
+            newTable[c] = sd->cmdTable[c];
+        if (sd->cmdTable) sd->oldCmdTables.append(sd->cmdTable);
+        __sync_synchronize();
+        sd->cmdTable = newTable;
+        sd->cmdTableSize = newSize;
+    }
+    for (int c = 0; c < numCmds; c++)
+        sd->cmdTable[numQueued + c] = &block[c];
+    // Anything added after a loaded program means the queue isn't just that program any more...
+    if (numQueued > 0) sd->programBlock = NULL;
+    sd->cmdBlocks.append(block);
+    __sync_synchronize();
+    sd->numQueuedCmds = numQueued + numCmds;
+    pthread_mutex_unlock(&sd->lock);
+    wakeStepperThread();
+}
+
+// Free all of a motor's commands, it mustn't be stepping...
+void stepper::freeCmds(int motorNum)
+{
+    stepperData *sd = &stepData[motorNum];
+    pthread_mutex_lock(&sd->lock);
+    reapProgram(sd);
+    sd->numQueuedCmds = 0;
+    sd->programBlock = NULL;
+    while (!sd->cmdBlocks.isEmpty())
+        delete [] sd->cmdBlocks.takeFirst();
+    while (!sd->oldCmdTables.isEmpty())
+        delete [] sd->oldCmdTables.takeFirst();
+    // Forget any program waiting to go next too...
+    freeProgram(sd->nextProgram);
+    sd->nextProgram = NULL;
+    pthread_mutex_unlock(&sd->lock);
+}
+
+// Swap a motor's pending next program in - called from the motor's step thread only.
+// Only the tables change hands here, everything we swapped out is left in retiredProgram
+// for reapProgram() so the step thread never frees anything.  Returns 1 if it was swapped
+// in, 0 if there's nothing to swap and -1 if a writer has the queue (try again next cycle)...
+int stepper::swapProgram(int motorNum)
+{
+    stepperData *sd = &stepData[motorNum];
+    stepperProgram *next = sd->nextProgram;
+    if (!next || sd->retiredProgram)
+        return(0);
+    if (pthread_mutex_trylock(&sd->lock))
+        return(-1);
+    next = sd->nextProgram;
+    if (!next) {
+        pthread_mutex_unlock(&sd->lock);
+        return(0);
+    }
+    stepperCmd **oldTable = sd->cmdTable;
+    int oldTableSize = sd->cmdTableSize;
+    sd->cmdTable = next->table;
+    sd->cmdTableSize = next->tableSize;
+    sd->numQueuedCmds = next->numCmds;
+    sd->currQueuedCmd = 0;
+    sd->loopDepth = 0;
+    sd->programBlock = NULL;
+    next->table = oldTable;
+    next->tableSize = oldTableSize;
+    sd->nextProgram = NULL;
+    sd->retiredProgram = next;
+    pthread_mutex_unlock(&sd->lock);
+    return(1);
+}
+
+// Free whatever the step thread swapped out, must hold the motor's lock.
+// The swapped in program's block becomes the only command storage in use...
+void stepper::reapProgram(stepperData *sd)
+{
+    stepperProgram *retired = sd->retiredProgram;
+    if (!retired)
+        return;
+    while (!sd->cmdBlocks.isEmpty())
+        delete [] sd->cmdBlocks.takeFirst();
+    while (!sd->oldCmdTables.isEmpty())
+        delete [] sd->oldCmdTables.takeFirst();
+    delete [] retired->table;
+    sd->cmdBlocks.append(retired->block);
+    delete retired;
+    sd->retiredProgram = NULL;
+}
+
+// Queue a move command for a motor...
+int stepper::queueMoveCmd(int motorNum, double distance, double duration, double accel)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS || !planMoveValid(&stepData[motorNum].axis, distance, duration, accel))
+        return(-1);
+    // Create a move command and add it to the thread's list...
+    stepperCmd *newMove = new stepperCmd[1];
+    convertMove(motorNum, newMove, distance, duration, accel);
+    dumpCmd("ADDING Move", newMove);
+    publishCmds(motorNum, newMove, 1);
+    return(0);
+}
+
+// Queue a pause command for a motor...
+int stepper::queuePauseCmd(int motorNum, double duration)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS || !planPauseValid(duration))
+        return(-1);
+    // Create a pause command and add it to the thread's list...
+    stepperCmd *newPause = new stepperCmd[1];
+    convertPause(newPause, duration);
+    dumpCmd("ADDING Pause", newPause);
+    publishCmds(motorNum, newPause, 1);
+    return(0);
+}
+
+void stepper::queueLoopStartCmd(int motorNum)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS)
+        return;
+    stepperCmd *newCmd = new stepperCmd[1];
+    convertLoopStart(newCmd);
+    dumpCmd("ADDING loop start", newCmd);
+    publishCmds(motorNum, newCmd, 1);
+}
+
+// Queue a loop end, startLoopIndex has to be a loop start that's already queued...
+int stepper::queueLoopEndCmd(int motorNum, int startLoopIndex, int cycleCounter)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS)
+        return(-1);
+    stepperData *sd = &stepData[motorNum];
+    pthread_mutex_lock(&sd->lock);
+    bool valid = (startLoopIndex >= 0 && startLoopIndex < sd->numQueuedCmds
+                  && sd->cmdTable[startLoopIndex]->cmdType == STEPCMD_LOOP_START);
+    pthread_mutex_unlock(&sd->lock);
+    if (!valid)
+        return(-1);
+    stepperCmd *newCmd = new stepperCmd[1];
+    convertLoopEnd(newCmd, startLoopIndex, cycleCounter);
     dumpCmd("ADDING loop end", newCmd);
+    publishCmds(motorNum, newCmd, 1);
+    return(0);
+}
+
+// Queue a move to an absolute position (mm) for a motor...
+int stepper::queueMoveToCmd(int motorNum, double position, double duration, double accel)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS || !planMoveToValid(position, duration, accel))
+        return(-1);
+    stepperCmd *newMove = new stepperCmd[1];
+    convertMoveTo(motorNum, newMove, position, duration, accel);
+    dumpCmd("ADDING Move to", newMove);
+    publishCmds(motorNum, newMove, 1);
+    return(0);
+}
+
+// Check a program and convert it into a new[] block of commands.  Loop end commands jump
+// to the index of their loop start within the program, publishCmds() can move them on
+// to wherever the block goes in the motor's command table.  Returns NULL if any command is bad...
+stepperCmd *stepper::compileProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds)
+{
+    // Check everything before we touch anything, moves have to take at least a step...
+    for (int c = 0; c < numCmds; c++) {
+        const stepperProgramCmd *cmd = &cmds[c];
+        switch (cmd->cmdType) {
+        case STEPCMD_MOVE:
+            if (!planMoveValid(&stepData[motorNum].axis, cmd->value, cmd->duration, cmd->accel)) return(NULL);
+            break;
+        case STEPCMD_MOVE_TO:
+            if (!planMoveToValid(cmd->value, cmd->duration, cmd->accel)) return(NULL);
+            break;
+        case STEPCMD_PAUSE:
+            if (!planPauseValid(cmd->duration)) return(NULL);
+            break;
+        case STEPCMD_LOOP_START:
+        case STEPCMD_SYNC:
+            break;
+        case STEPCMD_LOOP_STOP:
+            if (cmd->loopStart < 0 || cmd->loopStart >= c || cmds[cmd->loopStart].cmdType != STEPCMD_LOOP_START)
+                return(NULL);
+            break;
+        default:
+            return(NULL);
+        }
+    }
+    stepperCmd *block = new stepperCmd[numCmds];
+    for (int c = 0; c < numCmds; c++) {
+        const stepperProgramCmd *cmd = &cmds[c];
+        switch (cmd->cmdType) {
+        case STEPCMD_MOVE:
+            convertMove(motorNum, &block[c], cmd->value, cmd->duration, cmd->accel);
+            break;
+        case STEPCMD_MOVE_TO:
+            convertMoveTo(motorNum, &block[c], cmd->value, cmd->duration, cmd->accel);
+            break;
+        case STEPCMD_PAUSE:
+            convertPause(&block[c], cmd->duration);
+            break;
+        case STEPCMD_LOOP_START:
+            convertLoopStart(&block[c]);
+            break;
+        case STEPCMD_SYNC:
+            convertSync(&block[c]);
+            break;
+        case STEPCMD_LOOP_STOP:
+            convertLoopEnd(&block[c], cmd->loopStart, (int)cmd->value);
+            break;
+        }
+    }
+    return(block);
+}
+
+// Queue a whole program for a motor in one go.
+// Everything is checked first and nothing is queued if any command is bad.  The
+// commands are converted into a single allocation and handed to the step thread
+// all at once.  Returns the number of commands queued or -1...
+int stepper::queueBatch(int motorNum, const stepperProgramCmd *cmds, int numCmds)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS || numCmds < 0)
+        return(-1);
+    if (numCmds == 0)
+        return(0);
+    // Loop indexes are relative to the start of the batch until it's published...
+    stepperCmd *block = compileProgram(motorNum, cmds, numCmds);
+    if (!block)
+        return(-1);
+    publishCmds(motorNum, block, numCmds, true);
+    return(numCmds);
+}
+
+// FNV-1a hash of a program and everything about the motor that goes into compiling it...
+static void hashBytes(unsigned long long *hash, const void *data, int len)
+{
+    const unsigned char *bytes = (const unsigned char *)data;
+    for (int b = 0; b < len; b++) {
+        *hash ^= bytes[b];
+        *hash *= 1099511628211ULL;
+    }
+}
+
+unsigned long long stepper::programHash(int motorNum, const stepperProgramCmd *cmds, int numCmds)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    stepperData *sd = &stepData[motorNum];
+    hashBytes(&hash, &cycleFreq, sizeof(cycleFreq));
+    hashBytes(&hash, &sd->axis.stepsPerMM, sizeof(sd->axis.stepsPerMM));
+    hashBytes(&hash, &sd->axis.minCyclesPerStep, sizeof(sd->axis.minCyclesPerStep));
+    hashBytes(&hash, &sd->axis.msRatio, sizeof(sd->axis.msRatio));
+    hashBytes(&hash, &sd->axis.msCruiseCycles, sizeof(sd->axis.msCruiseCycles));
+    hashBytes(&hash, &numCmds, sizeof(numCmds));
+    // Field by field, so structure padding doesn't get in...
+    for (int c = 0; c < numCmds; c++) {
+        hashBytes(&hash, &cmds[c].cmdType, sizeof(cmds[c].cmdType));
+        hashBytes(&hash, &cmds[c].value, sizeof(cmds[c].value));
+        hashBytes(&hash, &cmds[c].duration, sizeof(cmds[c].duration));
+        hashBytes(&hash, &cmds[c].accel, sizeof(cmds[c].accel));
+        hashBytes(&hash, &cmds[c].loopStart, sizeof(cmds[c].loopStart));
+    }
+    return(hash);
+}
+
+// Replace everything queued for a motor with a program.
+// The compiled commands are cached, keyed by a hash of the program and the motor's
+// configuration, so loading the same program again skips compiling it.  If the queue
+// still holds that program it's just rewound in place.  The motor is stopped.
+// Returns 1 if the cached copy was used, 0 if the program was compiled, -1 if it's bad...
+int stepper::loadProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS || numCmds < 0)
+        return(-1);
+    stepperData *sd = &stepData[motorNum];
+    unsigned long long hash = programHash(motorNum, cmds, numCmds);
+    if (sd->cachedProgram && hash == sd->cachedProgramHash && numCmds == sd->cachedProgramSize) {
+        // Still queued - stop the motor (and wait for the step thread to let go of
+        // the commands) then put every command back the way it started...
+        if (sd->programBlock && sd->numQueuedCmds == numCmds) {
+            stopMotor(motorNum);
+            memcpy(sd->programBlock, sd->cachedProgram, numCmds * sizeof(stepperCmd));
+            sd->currQueuedCmd = 0;
+            sd->loopDepth = 0;
+            sd->holdState = HOLD_NONE;
+            return(1);
+        }
+        clearMotor(motorNum);
+        stepperCmd *block = new stepperCmd[numCmds];
+        memcpy(block, sd->cachedProgram, numCmds * sizeof(stepperCmd));
+        publishCmds(motorNum, block, numCmds);
+        sd->programBlock = block;
+        return(1);
+    }
+    // Not seen it before, compile it and keep a pristine copy...
+    stepperCmd *block = (numCmds > 0)?compileProgram(motorNum, cmds, numCmds):NULL;
+    if (numCmds > 0 && !block)
+        return(-1);
+    clearMotor(motorNum);
+    delete [] sd->cachedProgram;
+    sd->cachedProgram = new stepperCmd[(numCmds > 0)?numCmds:1];
+    if (numCmds > 0) {
+        memcpy(sd->cachedProgram, block, numCmds * sizeof(stepperCmd));
+        publishCmds(motorNum, block, numCmds);
+    }
+    sd->cachedProgramSize = numCmds;
+    sd->cachedProgramHash = hash;
+    sd->programBlock = block;
+    // Keep it with the journal in case we have to pick it up again after a restart...
+    journal.saveProgram(motorNum, hash, cmds, numCmds);
+    return(0);
+}
+
+// Queue a program for every motor, each motor's commands are handed over in one go.
+// Every program is compiled first, nothing's queued if any of them are bad...
+int stepper::queueBatchAll(const stepperProgramCmd *const cmds[NUM_MOTORS], const int numCmds[NUM_MOTORS])
+{
+    controlGuard guard(&controlLock);
+    stepperCmd *blocks[NUM_MOTORS];
+    int total = 0;
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++) {
+        blocks[motorNum] = (numCmds[motorNum] > 0)?compileProgram(motorNum, cmds[motorNum], numCmds[motorNum]):NULL;
+        if (numCmds[motorNum] < 0 || (numCmds[motorNum] > 0 && !blocks[motorNum])) {
+            for (int n = 0; n < motorNum; n++)
+                delete [] blocks[n];
+            return(-1);
+        }
+        total += numCmds[motorNum];
+    }
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
+        if (blocks[motorNum])
+            publishCmds(motorNum, blocks[motorNum], numCmds[motorNum], true);
+    return(total);
+}
+
+// Get a program ready to follow the one a motor's running now.
+// The step thread swaps it in without missing a cycle when the current program runs out
+// or reaches a sync point (STEPCMD_SYNC), so back to back jobs run continuously.  A next
+// program that's still waiting is replaced.  If the motor isn't running the program waits
+// until it's started and has finished what's queued.  Returns the number of commands or -1...
+int stepper::queueNextProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS || numCmds < 0)
+        return(-1);
+    if (numCmds == 0)
+        return(0);
+    stepperProgram *program = makeProgram(motorNum, cmds, numCmds);
+    if (!program)
+        return(-1);
+    installNextProgram(motorNum, program);
+    return(numCmds);
+}
+
+// Get the next program ready for every motor, nothing's queued if any of them are bad...
+int stepper::queueNextProgramAll(const stepperProgramCmd *const cmds[NUM_MOTORS], const int numCmds[NUM_MOTORS])
+{
+    controlGuard guard(&controlLock);
+    stepperProgram *programs[NUM_MOTORS];
+    int total = 0;
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++) {
+        programs[motorNum] = (numCmds[motorNum] > 0)?makeProgram(motorNum, cmds[motorNum], numCmds[motorNum]):NULL;
+        if (numCmds[motorNum] < 0 || (numCmds[motorNum] > 0 && !programs[motorNum])) {
+            for (int n = 0; n < motorNum; n++)
+                freeProgram(programs[n]);
+            return(-1);
+        }
+        total += numCmds[motorNum];
+    }
+    for (int motorNum = 0; motorNum < NUM_MOTORS; motorNum++)
+        if (programs[motorNum])
+            installNextProgram(motorNum, programs[motorNum]);
+    return(total);
+}
+
+// Compile a program and build its command table, ready for the step thread to swap in...
+stepperProgram *stepper::makeProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds)
+{
+    stepperCmd *block = compileProgram(motorNum, cmds, numCmds);
+    if (!block)
+        return(NULL);
+    stepperProgram *program = new stepperProgram;
+    program->block = block;
+    program->numCmds = numCmds;
+    program->tableSize = (numCmds > CMD_TABLE_INIT_SIZE)?numCmds:CMD_TABLE_INIT_SIZE;
+    program->table = new stepperCmd *[program->tableSize];
+    for (int c = 0; c < numCmds; c++)
+        program->table[c] = &block[c];
+    return(program);
+}
+
+void stepper::freeProgram(stepperProgram *program)
+{
+    if (!program)
+        return;
+    delete [] program->table;
+    delete [] program->block;
+    delete program;
+}
+
+// Make a program the motor's next one, replacing any that's still waiting...
+void stepper::installNextProgram(int motorNum, stepperProgram *program)
+{
+    stepperData *sd = &stepData[motorNum];
+    pthread_mutex_lock(&sd->lock);
+    reapProgram(sd);
+    stepperProgram *old = sd->nextProgram;
+    // Everything's built before the step thread can see it...
+    __sync_synchronize();
+    sd->nextProgram = program;
+    pthread_mutex_unlock(&sd->lock);
+    freeProgram(old);
+    wakeStepperThread();
+}
+
+// Is there a program waiting to follow the one a motor's running...
+bool stepper::nextProgramPending(int motorNum)
+{
+    if (motorNum < 0 || motorNum >= NUM_MOTORS)
+        return(false);
+    return(stepData[motorNum].nextProgram != NULL);
+}
+
+// Set the absolute position (mm) of a motor, e.g. after homing.
+// The motor can't be stepping while we do this...
+int stepper::setPosition(int motorNum, double position)
+{
+    controlGuard guard(&controlLock);
+    if (motorNum < 0 || motorNum >= NUM_MOTORS)
+        return(-1);
+    if (stepData[motorNum].stepping)
+        return(-1);
+    stepData[motorNum].position = (long long int)floor(position * stepData[motorNum].axis.stepsPerMM + 0.5);
+    return(0);
+}
+
+double stepper::getStepsPerMM(int motorNum)
+{
+    if (motorNum < 0 || motorNum >= NUM_MOTORS)
+        return(0.0);
+    return(stepData[motorNum].axis.stepsPerMM);
 }
 
 void stepper::dumpCmd(const char *text, stepperCmd *cmd)
 {
-    printf("\n%s\n", text);
-    printf("  cmd: %d\n", cmd->cmdType);
-    printf("  triggerCounter: %ld\n", cmd->triggerCounter);
-    printf("  numTriggers: %ld\n", cmd->numTriggers);
-    printf("  cycleCounter: %ld\n", cmd->cycleCounter);
-    printf("  numCycles: %ld\n", cmd->numCycles);
-    printf("  initNumCycles: %ld\n", cmd->initNumCycles);
-    printf("  endNumCycles: %ld\n", cmd->endNumCycles);
-    printf("  dir: %d\n", cmd->dir);
+    rtLog(LOG_DEBUG, "%s: cmd %d triggers %ld/%ld cycles %ld/%ld init %ld end %ld dir %d",
+          text, cmd->cmdType, cmd->triggerCounter, cmd->numTriggers, cmd->cycleCounter,
+          cmd->numCycles, cmd->initNumCycles, cmd->endNumCycles, cmd->dir);
+    if (cmd->cmdType == STEPCMD_MOVE_TO)
+        rtLog(LOG_DEBUG, "%s: targetPos %lld duration %f", text, cmd->targetPos, cmd->duration);
+}
+
+// Turn step thread profiling on or off (PROFILE_* flags).
+// Each step thread starts its histograms and trace afresh the next time it ticks
+// with profiling on, whatever they held before stays readable until then...
+void stepper::setProfiling(int flags)
+{
+    controlGuard guard(&controlLock);
+    if (flags & PROFILE_TRACE) {
+        for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+            if (!groups[g].profile.trace)
+                groups[g].profile.trace = new phaseEvent[PROFILE_TRACE_SIZE];
+        }
+    }
+    profileGen++;
+    __sync_synchronize();
+    profileFlags = flags;
+}
+
+// Histogram for a group (which: PHASE_LATE wake lateness, PHASE_COMMANDS tick time,
+// PHASE_PULSES pulse time)...
+const latencyHistogram *stepper::getLatencyHistogram(int groupNum, int which)
+{
+    if (groupNum < 0 || groupNum >= NUM_AXIS_GROUPS)
+        return(NULL);
+    switch (which) {
+    case PHASE_LATE:
+        return(&groups[groupNum].profile.wake);
+    case PHASE_COMMANDS:
+        return(&groups[groupNum].profile.tick);
+    case PHASE_PULSES:
+        return(&groups[groupNum].profile.pulse);
+    }
+    return(NULL);
+}
+
+// Log a summary of every group's histograms...
+void stepper::logProfile()
+{
+    static const char *names[3] = {"wake", "tick", "pulse"};
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+        for (int h = 0; h < 3; h++) {
+            const latencyHistogram *hist = getLatencyHistogram(g, h);
+            rtLog(LOG_INFO, "Group %d %-5s n %llu p50 %lld p99 %lld p99.9 %lld p99.99 %lld max %lld (nS)",
+                  g, names[h], hist->getCount(), hist->valueAt(50.0), hist->valueAt(99.0),
+                  hist->valueAt(99.9), hist->valueAt(99.99), hist->getMax());
+        }
+    }
+}
+
+// Write the phase traces out as Chrome/Perfetto trace JSON, one track per group.
+// Safe while the step threads are still tracing, we only take events they've finished.
+// Returns the number of events written or -1...
+int stepper::writeProfileTrace(const char *path)
+{
+    FILE *out = fopen(path, "w");
+    if (!out) {
+        rtLog(LOG_ERROR, "Can't write profile trace %s", path);
+        return(-1);
+    }
+    int counts[NUM_AXIS_GROUPS];
+    long long int origin = -1;
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+        counts[g] = groups[g].profile.trace?groups[g].profile.traceCount:0;
+        if (counts[g] > 0 && (origin < 0 || groups[g].profile.trace[0].start < origin))
+            origin = groups[g].profile.trace[0].start;
+    }
+    __sync_synchronize();
+    int numEvents = 0;
+    fprintf(out, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+    for (int g = 0; g < NUM_AXIS_GROUPS; g++) {
+        fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"step group %d\"}}",
+                (g == 0)?"":",\n", g, g);
+        for (int e = 0; e < counts[g]; e++) {
+            const phaseEvent *event = &groups[g].profile.trace[e];
+            // Chrome wants uS...
+            fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+                    phaseName(event->phase), event->groupNum, (event->start - origin) / 1000.0, event->duration / 1000.0);
+            numEvents++;
+        }
+    }
+    fprintf(out, "\n]}\n");
+    fclose(out);
+    rtLog(LOG_INFO, "Wrote %d trace events to %s", numEvents, path);
+    return(numEvents);
 }
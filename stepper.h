@@ -1,66 +1,159 @@
 #ifndef STEPPER_H
 #define STEPPER_H
 
-#define NUM_MOTORS 2
+#define CYCLE_PERIOD_NS     25000   // Step thread cycle period (nS)
+#define CYCLE_RESYNC_NS     1000000 // Give up catching up on missed cycles after this long (nS)
+#define GROUP_START_LEAD_NS 20000000 // How far ahead (nS) of startup the groups' common epoch is
+#define SYNC_START_LEAD_NS  2000000 // How far ahead (nS) of the call a synchronised start is armed for
 #define STEP_LOG_SIZE     100000
-
-// Valid stepperCmd command types...
-#define STEPCMD_CHECK_LOOP_FREQ 1
-#define STEPCMD_MOVE            2
-#define STEPCMD_LOOP_START      3
-#define STEPCMD_LOOP_STOP       4
-#define STEPCMD_PAUSE           5
+#define CMD_TABLE_INIT_SIZE 64      // Initial size of a motor's command table
+#define TELEMETRY_SIZE      8192    // Telemetry ring size (must be a power of two)
+#define TELEMETRY_DECIMATE  8       // Step thread cycles per telemetry sample
 
 #include <pthread.h>
 #include <QList>
 
-// Queued step command...
-struct stepperCmd {
-    int cmdType;                // Command type
-    long int triggerCounter;    // Number of times triggered so far
-    long int numTriggers;       // Number of times to trigger
-    long int cycleCounter;      // Number of times cycled so far
-    long int numCycles;         // Number of times to cycle before triggering
-    long int initNumCycles;     // Initial number of times to cycle before triggering
-    long int endNumCycles;      // Ending number of times to cycle before triggering
-    int dir;                    // Which way to move (+1/-1)
+#include "precisiontimer.h"
+#include "clocksource.h"
+#include "machinestate.h"
+#include "stepprofile.h"
+#include "stepplan.h"
+#include "journal.h"
+
+// A compiled program waiting to replace a motor's queue, see queueNextProgram().
+// Once the step thread has swapped it in it holds the table it replaced...
+struct stepperProgram {
+    stepperCmd **table;
+    int tableSize;
+    int numCmds;
+    stepperCmd *block;          // The program's commands (new[])
+};
+
+// Telemetry sample published by the step thread...
+struct telemetrySample {
+    long long int time;                     // System time of the sample (uS)
+    unsigned int motorMask;                 // Motors (bits) whose positions are in this sample
+    long long int position[NUM_MOTORS];     // Absolute position of each motor
 };
 
 // StepperThread data, one per motor...
 struct stepperData {
-    int stepsPerMM;
+    stepAxis axis;              // Steps/mm, step rate limits and microstep ratio
     int stepPin;
     int dirPin;
+    int dirLevel;               // Level the step thread last drove dirPin to
     int enablePin;
-    int minCyclesPerStep;
+    int msPins[3];              // Microstep select pins (-1 if not wired)
+    int stepSize;               // Fine steps per step pulse right now (1 or msRatio)
     bool stepping;
     bool enabled;
+    volatile long long int startTime;   // Cycle (precisionTimer nS) to start stepping on, 0 = straight away
+    volatile int holdState;     // HOLD_* (machinestate.h), only moved on from HOLD_NONE by the step thread
     pthread_mutex_t lock;
-    QList<stepperCmd *> queuedCmdList;
+    stepperCmd **cmdTable;      // Queued commands as the step thread sees them
+    int cmdTableSize;           // Allocated size of cmdTable
+    volatile int numQueuedCmds; // Number of commands in cmdTable the step thread can run
+    QList<stepperCmd **> oldCmdTables;  // Outgrown tables, freed by clearMotor()
+    QList<stepperCmd *> cmdBlocks;      // Command storage (new[]), freed by clearMotor()
+    stepperCmd *programBlock;   // Block queued by loadProgram(), if the queue holds nothing else
+    stepperCmd *cachedProgram;  // Pristine compiled copy of the last program loaded
+    int cachedProgramSize;
+    unsigned long long cachedProgramHash;
+    stepperProgram *volatile nextProgram;   // Swapped in by the step thread at the end or a sync point
+    stepperProgram *retiredProgram;         // What it swapped out, freed by the next writer
     int currQueuedCmd;
+    long long int position;     // Absolute position (steps), only written by the step thread while stepping
+    int loopStack[JOURNAL_MAX_LOOPS];   // Loop ends of the loops we're inside, outermost first
+    int loopDepth;              // JOURNAL_MAX_LOOPS + 1 once they're nested too deep to keep track
     long long int stepLog[STEP_LOG_SIZE];
     int stepLogIndex;
 };
 
+class stepper;
+
+// Step thread data, one per axis group.  Each group has its own RT thread,
+// optionally pinned to its own core, and all groups count cycles from a common epoch...
+struct axisGroup {
+    stepper *owner;
+    int groupNum;
+    int cpu;                    // Core the group's thread is pinned to (-1 for any)
+    int numMotors;
+    int motors[NUM_MOTORS];     // Motors serviced by this group
+    pthread_t sThread;
+    bool started;               // sThread was created
+    precisionTimer cycleTimer;
+    // Single producer/single consumer telemetry ring, written by the group's thread...
+    telemetrySample telemetry[TELEMETRY_SIZE];
+    volatile unsigned int telemetryHead;
+    volatile unsigned int telemetryTail;
+    int telemetryCountdown;
+    // Seqlock covering this group's motors in the published machine state...
+    volatile unsigned int stateSeq;
+    long long int stateTime;
+    stepProfile profile;
+    bool checkpointDue;         // A motor's had work since the last journal checkpoint
+    volatile unsigned int tickSeq;  // Bumped at the end of every tick, see waitForTick()
+    bool sleeping;              // Waiting for work in waitWhileIdle() (under idleLock)
+};
+
 class stepper {
 private:
-    int fd;
-    pthread_t sThread;
     double cycleFreq;
-    struct timespec cycleDelay;
+    long long int cyclePeriod;      // Step thread cycle period (nS)
+    long long int cycleEpoch;       // CLOCK_MONOTONIC time (nS) of every group's first cycle
+    axisGroup groups[NUM_AXIS_GROUPS];
+    volatile bool groupsReleased;   // Every group's thread has been created, see stepperThread()
     struct timespec enableDelay;
     stepperData stepData[NUM_MOTORS];
     pthread_mutex_t pc_lock;
+    pthread_mutex_t controlLock;    // Serialises the public control calls, never taken by the step threads
+    pthread_mutex_t idleLock;   // Step thread sleeps on idleCond while there's nothing to do
+    pthread_cond_t idleCond;
     QList<stepperCmd *> priorityCmdList;
-    long long int *timer; // Pointer to 64 bit 1mHz timer
-    int pthreadStatus;
+    clockSource sysClock; // 1 MHz system time
+    volatile int pthreadStatus; // Non zero tells the step threads to finish up
+    machineState publishedState;
+    volatile int profileFlags;      // PROFILE_* switches the step threads check every tick
+    volatile unsigned int profileGen;   // Bumped to have the step threads start their profiles afresh
+    volatile bool holdRequested;    // Feed hold, see feedHold()
+    progressJournal journal;
+    volatile long int journalCycles;    // Step thread cycles between checkpoints, 0 = none
     //
-    void initSysTime();
     inline long long int getSysTime(void);
     static void *stepperThread1 (void *);
-    void stepperThread();
+    void stepperThread(axisGroup *grp);
+    void pinToCpu(axisGroup *grp);
+    long long int nextCycleAfter(long long int t);
     void setStepperEnable(int, bool);
+    void enableSteppers(const bool motors[NUM_MOTORS]);
     void dumpCmd(const char *, stepperCmd *);
+    void convertMove(int motorNum, stepperCmd *newMove, double distance, double duration, double accel);
+    void convertMoveTo(int motorNum, stepperCmd *newMove, double position, double duration, double accel);
+    void convertPause(stepperCmd *newPause, double duration);
+    void convertLoopStart(stepperCmd *newCmd);
+    void convertLoopEnd(stepperCmd *newCmd, int startLoopIndex, int cycleCounter);
+    void convertSync(stepperCmd *newCmd);
+    void publishCmds(int motorNum, stepperCmd *block, int numCmds, bool relocate = false);
+    void freeCmds(int motorNum);
+    int swapProgram(int motorNum);
+    stepperProgram *makeProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds);
+    void freeProgram(stepperProgram *program);
+    void installNextProgram(int motorNum, stepperProgram *program);
+    void reapProgram(stepperData *sd);
+    stepperCmd *compileProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds);
+    unsigned long long programHash(int motorNum, const stepperProgramCmd *cmds, int numCmds);
+    void setMicrostep(int motorNum, int stepSize);
+    inline void publishTelemetry(axisGroup *grp);
+    inline void publishState(axisGroup *grp);
+    inline void checkpoint(axisGroup *grp, long long int cycle);
+    inline void trackLoop(stepperData *sd, int loopEnd, bool looping);
+    inline void profileTick(axisGroup *grp, int profiling, long long int deadline, long long int wakeTime,
+                            long long int pulseStart, long long int pulseEnd, long long int tickEnd);
+    bool resolveMoveTo(int motorNum, stepperCmd *cmd);
+    bool stepperIdle(axisGroup *grp);
+    void waitWhileIdle(axisGroup *grp);
+    void wakeStepperThread(void);
+    void waitForTick(int motorNum);
 
 public:
     stepper();
@@ -70,6 +163,15 @@ public:
     void stopAll();
     void resetAll();
     void clearAll();
+    long long int startSynced(const bool motors[NUM_MOTORS]);
+    void feedHold();
+    void feedResume();
+    bool isHeld();
+    bool feedHoldRequested() { return(holdRequested); }
+    // Progress journal...
+    void setJournalInterval(int ms);
+    bool canResume();
+    int resumeFromJournal();
     // Queued command control...
     void startMotor(int motorNum);
     void stopMotor(int motorNum);
@@ -79,12 +181,31 @@ public:
     int queueMoveCmd(int motorNum, double distance, double duration, double accel);
     int queuePauseCmd(int motorNum, double duration);
     void queueLoopStartCmd(int motorNum);
-    void queueLoopEndCmd(int motorNum, int startLoopIndex, int cycleCounter);
+    int queueLoopEndCmd(int motorNum, int startLoopIndex, int cycleCounter);
+    int queueMoveToCmd(int motorNum, double position, double duration, double accel);
+    int queueBatch(int motorNum, const stepperProgramCmd *cmds, int numCmds);
+    int queueBatchAll(const stepperProgramCmd *const cmds[NUM_MOTORS], const int numCmds[NUM_MOTORS]);
+    int loadProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds);
+    int queueNextProgram(int motorNum, const stepperProgramCmd *cmds, int numCmds);
+    int queueNextProgramAll(const stepperProgramCmd *const cmds[NUM_MOTORS], const int numCmds[NUM_MOTORS]);
+    bool nextProgramPending(int motorNum);
+    // Absolute position control...
+    int setPosition(int motorNum, double position);
+    double getStepsPerMM(int motorNum);
+    void getMachineState(machineState *state);
     // Stepper log control and access...
     void stepperLogStart(int motorNum);
     void stepperLogStop(int motorNum);
     void stepperLogReset(int motorNum);
     long long int *getStepperLog(int motorNum);
+    // Telemetry access (single reader only), merged across the axis groups in time order...
+    int readTelemetry(telemetrySample *samples, int maxSamples);
+    // Step thread profiling...
+    void setProfiling(int flags);
+    int getProfiling() { return(profileFlags); }
+    const latencyHistogram *getLatencyHistogram(int groupNum, int which);
+    void logProfile();
+    int writeProfileTrace(const char *path = PROFILE_TRACE_PATH);
 };
 
 #endif
@@ -0,0 +1,311 @@
+#ifndef STEPPLAN_H
+#define STEPPLAN_H
+
+// Step commands and the maths that turns moves into step timings, shared by the
+// stepper engine and the offline tools so they always agree about what the
+// engine is trying to do.  No Qt, no pthreads...
+
+#define MIN_LOOPS_PER_STEP  15
+#define STEPS_PER_MM        441     // Fine (full resolution) microsteps
+#define MS_CRUISE_LOOPS_PER_STEP  (2 * MIN_LOOPS_PER_STEP)  // Cruising faster than this uses coarse steps
+
+// Valid stepperCmd command types...
+#define STEPCMD_CHECK_LOOP_FREQ 1
+#define STEPCMD_MOVE            2
+#define STEPCMD_LOOP_START      3
+#define STEPCMD_LOOP_STOP       4
+#define STEPCMD_PAUSE           5
+#define STEPCMD_MOVE_TO         6
+#define STEPCMD_SYNC            7   // Point where a pending next program can be swapped in
+
+// What planStep() did...
+#define PLAN_MS_CHANGE      0x01    // The motor's microstep mode changed
+#define PLAN_MOVE_DONE      0x02    // That was the move's last step
+#define PLAN_HELD           0x04    // A feed hold's slow down has brought the move to a stop
+
+#include <math.h>
+
+// Queued step command...
+struct stepperCmd {
+    int cmdType;                // Command type
+    long int triggerCounter;    // Number of times triggered so far
+    long int numTriggers;       // Number of times to trigger
+    long int cycleCounter;      // Number of times cycled so far
+    long int numCycles;         // Number of times to cycle before triggering
+    long int initNumCycles;     // Initial number of times to cycle before triggering
+    long int endNumCycles;      // Ending number of times to cycle before triggering
+    int dir;                    // Which way to move (+1/-1)
+    long long int targetPos;    // Absolute target position (steps) of a "move to" command
+    double duration;            // Duration (sec) of a "move to" command
+    long int rampStart;         // Fine steps into the move where the current speed ramp started
+    long int decelSteps;        // Steps left in a feed hold's slow down (0 if not slowing)
+    long int cyclesLeft;        // Cycles a "move to" has left to finish on time (0 if it's not keeping time)
+};
+
+// One command of a program handed to queueBatch()...
+struct stepperProgramCmd {
+    int cmdType;                // STEPCMD_MOVE, _MOVE_TO, _PAUSE, _LOOP_START, _LOOP_STOP or _SYNC
+    double value;               // Distance (mm), position (mm) or loop count (<0 = forever)
+    double duration;            // Duration (sec) of moves and pauses
+    double accel;               // Acceleration of moves
+    int loopStart;              // Loop ends: index of the matching loop start in the batch
+};
+
+// What the planning maths needs to know about a motor...
+struct stepAxis {
+    int stepsPerMM;
+    int minCyclesPerStep;
+    int msRatio;                // Fine steps per coarse step (1 if we can't switch)
+    long int msCruiseCycles;    // Moves cruising faster than this (cycles per fine step) use coarse steps
+};
+
+// Limit how few cycles a motor can take per step.  Motors that can switch to coarse
+// microsteps may ask for fine step rates beyond minCyclesPerStep, since they'll
+// actually be taking stepSize times fewer steps...
+inline long int planClampEndCycles(const stepAxis *axis, long int endNumCycles)
+{
+    long int minCycles = (axis->minCyclesPerStep + axis->msRatio - 1) / axis->msRatio;
+    if (minCycles < 1) minCycles = 1;
+    return((endNumCycles < minCycles)?minCycles:endNumCycles);
+}
+
+// Can a move of distance (mm) taking duration (sec) be planned?  It has to take at
+// least one step, and a move that takes no time or never speeds up can't...
+inline bool planMoveValid(const stepAxis *axis, double distance, double duration, double accel)
+{
+    return(isfinite(distance) && duration > 0.0 && accel > 0.0
+           && (long int)(fabs(distance) * axis->stepsPerMM) >= 1);
+}
+
+// Same for a move to an absolute position (mm), its distance isn't known until it's reached...
+inline bool planMoveToValid(double position, double duration, double accel)
+{
+    return(isfinite(position) && duration > 0.0 && accel > 0.0);
+}
+
+// A pause can be as short as we like (it's stretched to a cycle), but not negative...
+inline bool planPauseValid(double duration)
+{
+    return(duration >= 0.0 && isfinite(duration));
+}
+
+// Fill in a move of distance (mm) taking duration (sec)...
+inline void planMove(const stepAxis *axis, double cycleFreq, stepperCmd *newMove, double distance, double duration, double accel)
+{
+    newMove->cmdType = STEPCMD_MOVE;
+    double adistance = fabs(distance);
+    newMove->numTriggers = (long int)(adistance * axis->stepsPerMM);
+    newMove->triggerCounter = newMove->numTriggers;
+    double triggersPerSec = (adistance / duration) * (double)(axis->stepsPerMM);
+    long int endNumCycles = planClampEndCycles(axis, (long int)(cycleFreq / triggersPerSec));
+    long int initNumCycles = (long int)(200.0 / accel);
+    if (initNumCycles < endNumCycles) initNumCycles = endNumCycles;
+    if (initNumCycles < axis->minCyclesPerStep) initNumCycles = axis->minCyclesPerStep;
+    newMove->numCycles = initNumCycles;
+    newMove->cycleCounter = 1;
+    newMove->initNumCycles = initNumCycles;
+    newMove->endNumCycles = endNumCycles;
+    newMove->dir = (distance < 0)?-1:1;
+    newMove->targetPos = 0;
+    newMove->duration = 0.0;
+    newMove->rampStart = 0;
+    newMove->decelSteps = 0;
+    newMove->cyclesLeft = 0;
+}
+
+// Fill in a move to an absolute position (mm),
+// the distance is worked out by planResolveMoveTo() when it's reached...
+inline void planMoveTo(const stepAxis *axis, stepperCmd *newMove, double position, double duration, double accel)
+{
+    newMove->cmdType = STEPCMD_MOVE_TO;
+    newMove->targetPos = (long long int)floor(position * axis->stepsPerMM + 0.5);
+    newMove->duration = duration;
+    newMove->numTriggers = 0;
+    newMove->triggerCounter = 0;
+    newMove->initNumCycles = (long int)(200.0 / accel);
+    newMove->numCycles = newMove->initNumCycles;
+    newMove->cycleCounter = 1;
+    newMove->endNumCycles = 0;
+    newMove->dir = 0;
+    newMove->rampStart = 0;
+    newMove->decelSteps = 0;
+    newMove->cyclesLeft = 0;
+}
+
+// Work out a "move to" from where the motor is now (fine steps).  It keeps time: the first
+// step waits out a step time like the rest, and planStep() spreads whatever time the ramp
+// up leaves over the steps still to go, so the move takes its duration and the axes of a
+// G-code block finish together.  False if it's already there and there's nothing to do...
+inline bool planResolveMoveTo(const stepAxis *axis, double cycleFreq, stepperCmd *cmd, long long int position)
+{
+    long long int distance = cmd->targetPos - position;
+    if (distance == 0)
+        return(false);
+    cmd->dir = (distance < 0)?-1:1;
+    cmd->numTriggers = (long int)((distance < 0)?-distance:distance);
+    cmd->triggerCounter = cmd->numTriggers;
+    long int endNumCycles = planClampEndCycles(axis, (long int)(cycleFreq * cmd->duration / (double)cmd->numTriggers));
+    cmd->endNumCycles = endNumCycles;
+    if (cmd->initNumCycles < endNumCycles) cmd->initNumCycles = endNumCycles;
+    if (cmd->initNumCycles < axis->minCyclesPerStep) cmd->initNumCycles = axis->minCyclesPerStep;
+    cmd->numCycles = cmd->initNumCycles;
+    cmd->cycleCounter = cmd->numCycles;
+    cmd->rampStart = 0;
+    cmd->decelSteps = 0;
+    cmd->cyclesLeft = (long int)(cycleFreq * cmd->duration + 0.5);
+    return(true);
+}
+
+// Fill in a pause command.  It has to last at least a cycle or its
+// counter would start at (or below) zero and never trigger...
+inline void planPause(double cycleFreq, stepperCmd *newPause, double duration)
+{
+    newPause->cmdType = STEPCMD_PAUSE;
+    newPause->numTriggers = 1;
+    newPause->triggerCounter = 1;
+    long int numCycles = (long int)(cycleFreq * duration) - 1;
+    if (numCycles < 1) numCycles = 1;
+    newPause->numCycles = numCycles;
+    newPause->cycleCounter = numCycles;
+    newPause->initNumCycles = numCycles;
+    newPause->endNumCycles = 0;
+    newPause->dir = 0;
+    newPause->targetPos = 0;
+    newPause->duration = 0.0;
+    newPause->rampStart = 0;
+    newPause->decelSteps = 0;
+    newPause->cyclesLeft = 0;
+}
+
+// A move has just triggered (its triggerCounter already counted down once): take the
+// step and set up for the next one.  Triggers and positions are always in fine steps,
+// a coarse step is stepSize of them.  Returns PLAN_* flags...
+inline int planStep(const stepAxis *axis, stepperCmd *currCmd, int *stepSize, long long int *position)
+{
+    int result = 0;
+    currCmd->triggerCounter -= *stepSize - 1;
+    *position += (currCmd->dir < 0)?-*stepSize:*stepSize;
+    // A "move to" keeping time takes off the step time that's just gone, and cruises at
+    // whatever rate gets the rest of its steps done in the time it has left...
+    if (currCmd->cyclesLeft > 0) {
+        currCmd->cyclesLeft -= currCmd->numCycles;
+        if (currCmd->cyclesLeft > 0 && currCmd->triggerCounter > 0)
+            currCmd->endNumCycles = planClampEndCycles(axis, (currCmd->cyclesLeft + currCmd->triggerCounter / 2) / currCmd->triggerCounter);
+    }
+    // If there are more triggers in the "move" command
+    // Then set things up for the next iteration
+    // Else the move's done...
+    if (currCmd->triggerCounter && currCmd->decelSteps > 0) {
+        // Slowing down for a feed hold, the last whole coarse step has to be taken in fine steps...
+        if (*stepSize > 1 && currCmd->triggerCounter < *stepSize) {
+            result |= PLAN_MS_CHANGE;
+            currCmd->numCycles /= *stepSize;
+            currCmd->decelSteps *= *stepSize;
+            *stepSize = 1;
+        }
+        // Run the ramp backwards, 1 - 1/2n per step on the way up is 2n/(2n - 1) on the way down...
+        long int n = currCmd->decelSteps--;
+        currCmd->numCycles = (long int)((double)currCmd->numCycles * (2.0 * n) / (2.0 * n - 1.0));
+        currCmd->cycleCounter = currCmd->numCycles;
+        if (currCmd->decelSteps == 0) {
+            // Stopped, pick up again at full resolution...
+            if (*stepSize > 1) {
+                result |= PLAN_MS_CHANGE;
+                *stepSize = 1;
+            }
+            result |= PLAN_HELD;
+        }
+    }
+    else if (currCmd->triggerCounter) {
+        long int floorCycles = currCmd->endNumCycles * *stepSize;
+        if (floorCycles < axis->minCyclesPerStep) floorCycles = axis->minCyclesPerStep;
+        // Switch to coarse steps once we're up to a fast cruise, on a coarse step boundary...
+        if (*stepSize == 1 && axis->msRatio > 1 && currCmd->endNumCycles < axis->msCruiseCycles
+                && currCmd->numCycles <= floorCycles && currCmd->triggerCounter >= 2 * axis->msRatio
+                && *position % axis->msRatio == 0) {
+            result |= PLAN_MS_CHANGE;
+            *stepSize = axis->msRatio;
+            currCmd->numCycles *= axis->msRatio;
+            floorCycles = currCmd->endNumCycles * *stepSize;
+            if (floorCycles < axis->minCyclesPerStep) floorCycles = axis->minCyclesPerStep;
+        }
+        // Back to fine steps when there isn't a whole coarse step left...
+        else if (*stepSize > 1 && currCmd->triggerCounter < *stepSize) {
+            result |= PLAN_MS_CHANGE;
+            currCmd->numCycles /= *stepSize;
+            *stepSize = 1;
+            floorCycles = (currCmd->endNumCycles < axis->minCyclesPerStep)?axis->minCyclesPerStep:currCmd->endNumCycles;
+            if (currCmd->numCycles < floorCycles) currCmd->numCycles = floorCycles;
+        }
+        // The ramp carries on in whichever step size we're using...
+        float  cim1 = (float)(currCmd->numCycles);
+        float ni = (float)((currCmd->numTriggers - currCmd->triggerCounter - currCmd->rampStart) / *stepSize) + 1.0;
+        long int ci = (int)(cim1 - 2.0 * cim1 / (4.0 * ni));
+        currCmd->numCycles = (ci < floorCycles)?floorCycles:ci;
+        currCmd->cycleCounter = currCmd->numCycles;
+    }
+    else {
+        // Always start the next command at full resolution...
+        if (*stepSize > 1) {
+            result |= PLAN_MS_CHANGE;
+            *stepSize = 1;
+        }
+        currCmd->numCycles = currCmd->initNumCycles;
+        currCmd->cycleCounter = 1;
+        currCmd->triggerCounter = currCmd->numTriggers;
+        currCmd->rampStart = 0;
+        currCmd->decelSteps = 0;
+        currCmd->cyclesLeft = 0;
+        // "Move to" commands get re-resolved each time they're reached...
+        if (currCmd->cmdType == STEPCMD_MOVE_TO)
+            currCmd->dir = 0;
+        result |= PLAN_MOVE_DONE;
+    }
+    return(result);
+}
+
+// True if a move has taken some of its steps and not yet all of them...
+inline bool planMoveUnderWay(const stepperCmd *cmd)
+{
+    return((cmd->cmdType == STEPCMD_MOVE || cmd->cmdType == STEPCMD_MOVE_TO)
+           && cmd->dir != 0 && cmd->triggerCounter != cmd->numTriggers);
+}
+
+// How far up its acceleration ramp a move running at its current rate would be, in steps
+// of stepSize.  After n fine steps the ramp's at about initNumCycles / sqrt(pi * n) cycles
+// per fine step, and the same acceleration in coarse steps takes stepSize times fewer...
+inline long int planRampIndex(const stepperCmd *cmd, int stepSize)
+{
+    double ratio = (double)(cmd->initNumCycles * stepSize) / (double)cmd->numCycles;
+    if (ratio <= 1.0)
+        return(0);
+    return((long int)(ratio * ratio / (M_PI * stepSize) + 0.5));
+}
+
+// Start bringing a move under way to a stop for a feed hold, taking as many steps as it
+// took to get up to speed so it slows down as hard as it was allowed to speed up.  A held
+// "move to" can't finish on time any more, so it stops keeping time and carries on at the
+// rate it was cruising at.  False if it's slow enough to stop straight away...
+inline bool planHold(stepperCmd *cmd, int stepSize)
+{
+    cmd->cyclesLeft = 0;
+    long int n = planRampIndex(cmd, stepSize);
+    long int stepsLeft = cmd->triggerCounter / stepSize;
+    cmd->decelSteps = (n < stepsLeft)?n:stepsLeft;
+    return(cmd->decelSteps > 0);
+}
+
+// Pick a held (or still slowing) move up again, ramping up from the rate it's at now...
+inline void planResume(stepperCmd *cmd, int stepSize, bool stopped)
+{
+    cmd->decelSteps = 0;
+    cmd->cyclesLeft = 0;
+    if (stopped) {
+        cmd->numCycles = cmd->initNumCycles;
+        cmd->cycleCounter = 1;
+    }
+    long int n = stopped?0:planRampIndex(cmd, stepSize);
+    cmd->rampStart = (cmd->numTriggers - cmd->triggerCounter) - n * stepSize;
+}
+
+#endif // STEPPLAN_H
@@ -0,0 +1,73 @@
+/*
+*************************************
+* stepprofile.cpp:
+*   Latency histograms and per-tick phase
+*   records for profiling the step threads
+*************************************
+*/
+
+#include <string.h>
+
+#include "stepprofile.h"
+
+static const char *phaseNames[NUM_PHASES] = {"late", "commands", "pulses", "housekeeping"};
+
+const char *phaseName(int phase)
+{
+    if (phase < 0 || phase >= NUM_PHASES)
+        return("?");
+    return(phaseNames[phase]);
+}
+
+latencyHistogram::latencyHistogram()
+{
+    reset();
+}
+
+void latencyHistogram::reset(void)
+{
+    memset((void *)counts, 0, sizeof(counts));
+    total = 0;
+    maxValue = 0;
+}
+
+// Which bucket a value lands in...
+int latencyHistogram::bucketOf(long long int value)
+{
+    if (value < PROFILE_SUB_BUCKETS)
+        return((value < 0)?0:(int)value);
+    int magnitude = 63 - __builtin_clzll((unsigned long long int)value);
+    if (magnitude >= PROFILE_MAGNITUDES)
+        return(PROFILE_BUCKETS - 1);
+    int shift = magnitude - PROFILE_SUB_BITS;
+    return((shift + 1) * PROFILE_SUB_BUCKETS + (int)((value >> shift) & (PROFILE_SUB_BUCKETS - 1)));
+}
+
+// The biggest value that lands in a bucket...
+long long int latencyHistogram::bucketTop(int bucket)
+{
+    if (bucket < PROFILE_SUB_BUCKETS)
+        return(bucket);
+    int shift = bucket / PROFILE_SUB_BUCKETS - 1;
+    long long int bottom = (long long int)(PROFILE_SUB_BUCKETS + bucket % PROFILE_SUB_BUCKETS) << shift;
+    return(bottom + (1LL << shift) - 1);
+}
+
+// The value that percentile (0-100) of the samples are at or below...
+long long int latencyHistogram::valueAt(double percentile) const
+{
+    unsigned long long int count = total;
+    if (count == 0)
+        return(0);
+    unsigned long long int wanted = (unsigned long long int)(percentile / 100.0 * (double)count + 0.5);
+    if (wanted < 1) wanted = 1;
+    unsigned long long int seen = 0;
+    for (int b = 0; b < PROFILE_BUCKETS; b++) {
+        seen += counts[b];
+        if (seen >= wanted) {
+            long long int top = bucketTop(b);
+            return((top < maxValue)?top:maxValue);
+        }
+    }
+    return(maxValue);
+}
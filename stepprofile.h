@@ -0,0 +1,68 @@
+#ifndef STEPPROFILE_H
+#define STEPPROFILE_H
+
+#define PROFILE_SUB_BITS      4         // Linear sub-buckets per power of two = 2^PROFILE_SUB_BITS
+#define PROFILE_SUB_BUCKETS   (1 << PROFILE_SUB_BITS)
+#define PROFILE_MAGNITUDES    40        // Biggest value (nS) histograms can tell apart = 2^PROFILE_MAGNITUDES
+#define PROFILE_BUCKETS       ((PROFILE_MAGNITUDES - PROFILE_SUB_BITS + 1) * PROFILE_SUB_BUCKETS)
+#define PROFILE_TRACE_SIZE    262144    // Phase events a group's trace holds before it stops recording
+#define PROFILE_TRACE_PATH    "/tmp/robotPanel-trace.json"
+
+// Profiling switches, see stepper::setProfiling()...
+#define PROFILE_HISTOGRAMS    0x01      // Keep latency histograms
+#define PROFILE_TRACE         0x02      // Record a trace of each tick's phases
+
+// Phases of a step thread tick...
+#define PHASE_LATE            0         // Deadline until we actually woke up
+#define PHASE_COMMANDS        1         // Working out which motors step
+#define PHASE_PULSES          2         // Driving the step pulses
+#define PHASE_HOUSEKEEPING    3         // Microstep changes, enables, telemetry
+#define NUM_PHASES            4
+
+// Log-linear (HDR style) histogram of nS latencies.
+// Values below PROFILE_SUB_BUCKETS are counted exactly, above that every power of two
+// is split into PROFILE_SUB_BUCKETS buckets so the error is never more than 1/16th.
+// Written by one thread, others can read it at any time and get a close enough answer...
+class latencyHistogram {
+private:
+    volatile unsigned int counts[PROFILE_BUCKETS];
+    volatile unsigned long long int total;
+    volatile long long int maxValue;
+
+public:
+    latencyHistogram();
+    void reset(void);
+    static int bucketOf(long long int value);
+    static long long int bucketTop(int bucket);
+    inline void record(long long int value)
+    {
+        counts[bucketOf(value)]++;
+        total++;
+        if (value > maxValue) maxValue = value;
+    }
+    unsigned long long int getCount(void) const { return(total); }
+    long long int getMax(void) const { return(maxValue); }
+    long long int valueAt(double percentile) const;
+};
+
+// One phase of one tick...
+struct phaseEvent {
+    long long int start;        // precisionTimer time (nS)
+    int duration;               // nS
+    short phase;
+    short groupNum;
+};
+
+// A step thread's profile.  Only the group's own thread writes to it...
+struct stepProfile {
+    latencyHistogram wake;      // How late we woke up for each tick
+    latencyHistogram tick;      // Wake up until all the tick's work is done
+    latencyHistogram pulse;     // Driving the step pulses, ticks that step only
+    phaseEvent *trace;          // PROFILE_TRACE_SIZE events (allocated when tracing is first turned on)
+    volatile int traceCount;
+    unsigned int generation;    // Last stepper::profileGen this profile was reset for
+};
+
+const char *phaseName(int phase);
+
+#endif // STEPPROFILE_H
@@ -0,0 +1,163 @@
+/*
+*************************************
+* stepctl.cpp:
+*   Drive a running robotPanel from the command line and
+*   measure how long it takes to queue commands
+*************************************
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "ipcclient.h"
+#include "stepprofile.h"
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: stepctl [-s socket] <command> [args]\n"
+            "  status\n"
+            "  move <motor> <distance mm> <duration sec> [accel]\n"
+            "  moveto <motor> <position mm> <duration sec> [accel]\n"
+            "  pause <motor> <duration sec>\n"
+            "  sethome <motor> <position mm>\n"
+            "  start|stop|reset|clear [motor]\n"
+            "  hold|resume   (feed hold, slow to a stop and carry on later)\n"
+            "  bench <motor> <count> [batch size]   (clears the motor's queue)\n"
+            "  profile hist|trace|all|off   (step thread profiling)\n"
+            "  profile dump   (log histograms, write " PROFILE_TRACE_PATH ")\n");
+    exit(1);
+}
+
+static long long int nowNS(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return((long long int)ts.tv_sec * 1000000000LL + ts.tv_nsec);
+}
+
+static void printState(const machineState &state)
+{
+    static const char *holdText[] = {"", " (slowing for hold)", " (held)"};
+    printf("time %lld uS\n", state.time);
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        const motorState &ms = state.motor[n];
+        printf("motor %d: %s pos %lld steps (%.3f mm) cmd %d/%d %.0f steps/s%s\n",
+               n, ms.stepping ? "stepping" : "stopped", ms.position, ms.positionMM,
+               ms.currQueuedCmd, ms.numQueuedCmds, ms.velocity, holdText[ms.hold]);
+    }
+}
+
+// Queue 'count' zero length pauses in batches and report the enqueue latency.
+// A batch bigger than a message would be sent part way through by the client, so it's clamped...
+static int bench(ipcClient &client, int motorNum, int count, int batchSize)
+{
+    if (count < 1 || batchSize < 1) {
+        fprintf(stderr, "stepctl: count and batch size have to be at least 1\n");
+        return(1);
+    }
+    if (batchSize > IPC_MAX_BATCH) {
+        fprintf(stderr, "stepctl: batch size clamped to %d\n", IPC_MAX_BATCH);
+        batchSize = IPC_MAX_BATCH;
+    }
+    long long int worst = 0, total = 0;
+    int batches = 0;
+    client.clear(motorNum);
+    client.flush();
+    long long int t0 = nowNS();
+    for (int sent = 0; sent < count; ) {
+        int n = (count - sent < batchSize)?(count - sent):batchSize;
+        for (int i = 0; i < n; i++)
+            client.pause(motorNum, 0.0);
+        long long int t1 = nowNS();
+        if (client.flush() != n) {
+            fprintf(stderr, "batch rejected (status %d)\n", client.getLastStatus());
+            return(1);
+        }
+        long long int dt = nowNS() - t1;
+        total += dt;
+        if (dt > worst) worst = dt;
+        batches++;
+        sent += n;
+    }
+    double elapsed = (nowNS() - t0) / 1e9;
+    printf("%d commands in %d batches: %.1f uS/batch avg, %.1f uS worst, %.0f commands/s\n",
+           count, batches, total / 1e3 / batches, worst / 1e3, count / elapsed);
+    client.clear(motorNum);
+    client.flush();
+    return(0);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *path = IPC_SOCKET_PATH;
+    int arg = 1;
+    if (arg + 1 < argc && !strcmp(argv[arg], "-s")) {
+        path = argv[arg + 1];
+        arg += 2;
+    }
+    if (arg >= argc)
+        usage();
+    const char *cmd = argv[arg++];
+    int nargs = argc - arg;
+    char **args = argv + arg;
+
+    ipcClient client;
+    if (!client.connectTo(path)) {
+        fprintf(stderr, "stepctl: can't connect to %s\n", path);
+        return(1);
+    }
+    if (!strcmp(cmd, "status")) {
+        machineState state;
+        if (!client.getState(&state)) {
+            fprintf(stderr, "stepctl: no status reply\n");
+            return(1);
+        }
+        printState(state);
+        return(0);
+    }
+    if (!strcmp(cmd, "bench")) {
+        if (nargs < 2) usage();
+        return(bench(client, atoi(args[0]), atoi(args[1]), (nargs > 2)?atoi(args[2]):IPC_MAX_BATCH));
+    }
+    if ((!strcmp(cmd, "move") || !strcmp(cmd, "moveto")) && nargs >= 3) {
+        double accel = (nargs > 3)?atof(args[3]):1.0;
+        if (!strcmp(cmd, "move"))
+            client.move(atoi(args[0]), atof(args[1]), atof(args[2]), accel);
+        else
+            client.moveTo(atoi(args[0]), atof(args[1]), atof(args[2]), accel);
+    }
+    else if (!strcmp(cmd, "pause") && nargs >= 2)
+        client.pause(atoi(args[0]), atof(args[1]));
+    else if (!strcmp(cmd, "sethome") && nargs >= 2)
+        client.setPosition(atoi(args[0]), atof(args[1]));
+    else if (!strcmp(cmd, "start"))
+        client.start((nargs > 0)?atoi(args[0]):-1);
+    else if (!strcmp(cmd, "stop"))
+        client.stop((nargs > 0)?atoi(args[0]):-1);
+    else if (!strcmp(cmd, "reset"))
+        client.reset((nargs > 0)?atoi(args[0]):-1);
+    else if (!strcmp(cmd, "clear"))
+        client.clear((nargs > 0)?atoi(args[0]):-1);
+    else if (!strcmp(cmd, "hold"))
+        client.hold();
+    else if (!strcmp(cmd, "resume"))
+        client.resume();
+    else if (!strcmp(cmd, "profile") && nargs >= 1) {
+        if (!strcmp(args[0], "dump")) client.profileDump();
+        else if (!strcmp(args[0], "hist")) client.profile(PROFILE_HISTOGRAMS);
+        else if (!strcmp(args[0], "trace")) client.profile(PROFILE_TRACE);
+        else if (!strcmp(args[0], "all")) client.profile(PROFILE_HISTOGRAMS | PROFILE_TRACE);
+        else if (!strcmp(args[0], "off")) client.profile(0);
+        else usage();
+    }
+    else
+        usage();
+    if (client.flush() < 0) {
+        fprintf(stderr, "stepctl: command rejected (status %d)\n", client.getLastStatus());
+        return(1);
+    }
+    return(0);
+}
@@ -0,0 +1,22 @@
+#-------------------------------------------------
+#
+# Command line client for the robotPanel command socket
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = stepctl
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../..
+
+SOURCES += stepctl.cpp \
+    ../../ipcclient.cpp
+
+HEADERS  += ../../ipcclient.h \
+    ../../ipcprotocol.h \
+    ../../stepprofile.h \
+    ../../machinestate.h
@@ -0,0 +1,396 @@
+/*
+*************************************
+* steptiming.cpp:
+*   Compare the step pulses a run actually produced
+*   with the ones the engine meant to produce
+*************************************
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "machinestate.h"
+#include "stepplan.h"
+#include "pi_stepper_pins.h"
+
+#define DEFAULT_CYCLE_FREQ  40000.0     // 1e9 / CYCLE_PERIOD_NS
+#define MAX_PROGRAM_CMDS    100000
+#define MAX_GPIO_PINS       64
+#define TRAILING_CYCLES     40000       // How far past the end of the trace infinite loops are followed
+
+// A step pulse, when it happened (cycles for ideal ones, nS for real ones) and which way...
+struct stepPulse {
+    long long int time;
+    int dir;
+    int stepSize;
+};
+
+// Error and ripple figures for one motor...
+struct motorReport {
+    long int numIdeal;
+    long int numActual;
+    long long int idealEnd;
+    long long int actualEnd;
+    long long int offset;           // Actual time (nS) of the ideal cycle 0
+    double meanError;
+    double rmsError;
+    long long int p99Error;
+    long long int maxError;
+    long int maxErrorStep;
+    double rmsRipple;               // Step interval error, % of the ideal interval
+    double maxRipple;
+    long int maxRippleStep;
+};
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: steptiming [options] <program> <trace>\n"
+            "  program: lines of '<motor> move <mm> <sec> [accel]', '<motor> moveto <mm> <sec> [accel]',\n"
+            "           '<motor> pause <sec>', '<motor> loop', '<motor> endloop <count>', '<motor> sync'\n"
+            "  trace:   lines of '<time nS> <pin> <value>' (e.g. a GPIO_SIM_TRACE file)\n"
+            "  -f <Hz>      step thread cycle frequency (default %.0f)\n"
+            "  -s <steps>   fine steps per mm (default %d)\n"
+            "  -m <cycles>  minimum cycles per step (default %d)\n"
+            "  -p <m>:<mm>  motor m's starting position (default 0)\n"
+            "  -t <nS>      fail if any step is further than this from its ideal time\n"
+            "  -r <%%>       fail if any step interval is further than this from ideal\n"
+            "  -v           list every step\n",
+            DEFAULT_CYCLE_FREQ, STEPS_PER_MM, MIN_LOOPS_PER_STEP);
+    exit(2);
+}
+
+// Read the program, one list of commands per motor...
+static bool readProgram(const char *path, std::vector<stepperProgramCmd> programs[NUM_MOTORS])
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "steptiming: can't open %s\n", path);
+        return(false);
+    }
+    std::vector<int> loopStarts[NUM_MOTORS];
+    char line[256], cmd[32];
+    int lineNum = 0;
+    while (fgets(line, sizeof(line), fp)) {
+        lineNum++;
+        char *hash = strchr(line, '#');
+        if (hash) *hash = 0;
+        int motorNum;
+        stepperProgramCmd pc;
+        pc.value = 0.0;
+        pc.duration = 0.0;
+        pc.accel = 1.0;
+        pc.loopStart = 0;
+        int n = sscanf(line, "%d %31s %lf %lf %lf", &motorNum, cmd, &pc.value, &pc.duration, &pc.accel);
+        if (n <= 0)
+            continue;
+        bool ok = (n >= 2 && motorNum >= 0 && motorNum < NUM_MOTORS);
+        if (ok && (!strcmp(cmd, "move") || !strcmp(cmd, "moveto"))) {
+            pc.cmdType = strcmp(cmd, "move")?STEPCMD_MOVE_TO:STEPCMD_MOVE;
+            ok = (n >= 4 && pc.duration > 0.0 && pc.accel > 0.0);
+        }
+        else if (ok && !strcmp(cmd, "pause")) {
+            pc.cmdType = STEPCMD_PAUSE;
+            pc.duration = pc.value;
+            ok = (n >= 3);
+        }
+        else if (ok && !strcmp(cmd, "loop")) {
+            pc.cmdType = STEPCMD_LOOP_START;
+            loopStarts[motorNum].push_back(programs[motorNum].size());
+        }
+        else if (ok && !strcmp(cmd, "endloop")) {
+            pc.cmdType = STEPCMD_LOOP_STOP;
+            ok = (n >= 3 && !loopStarts[motorNum].empty());
+            if (ok) {
+                pc.loopStart = loopStarts[motorNum].back();
+                loopStarts[motorNum].pop_back();
+            }
+        }
+        else if (ok && !strcmp(cmd, "sync"))
+            pc.cmdType = STEPCMD_SYNC;
+        else
+            ok = false;
+        if (!ok) {
+            fprintf(stderr, "steptiming: %s:%d: can't make sense of that\n", path, lineNum);
+            fclose(fp);
+            return(false);
+        }
+        programs[motorNum].push_back(pc);
+    }
+    fclose(fp);
+    return(true);
+}
+
+// Work out when the engine means to step, exactly as its step thread would but on a
+// perfect clock.  Times are cycles from when the motor started...
+static void planPulses(const stepAxis *axis, double cycleFreq, const std::vector<stepperProgramCmd> &program,
+                       long long int position, long long int maxCycles, std::vector<stepPulse> &pulses)
+{
+    int numCmds = program.size();
+    std::vector<stepperCmd> cmds(numCmds);
+    for (int c = 0; c < numCmds; c++) {
+        const stepperProgramCmd *pc = &program[c];
+        stepperCmd *cmd = &cmds[c];
+        memset(cmd, 0, sizeof(*cmd));
+        cmd->cmdType = pc->cmdType;
+        if (pc->cmdType == STEPCMD_MOVE)
+            planMove(axis, cycleFreq, cmd, pc->value, pc->duration, pc->accel);
+        else if (pc->cmdType == STEPCMD_MOVE_TO)
+            planMoveTo(axis, cmd, pc->value, pc->duration, pc->accel);
+        else if (pc->cmdType == STEPCMD_PAUSE)
+            planPause(cycleFreq, cmd, pc->duration);
+        else if (pc->cmdType == STEPCMD_LOOP_STOP) {
+            cmd->numTriggers = cmd->triggerCounter = (long int)pc->value;
+            cmd->dir = pc->loopStart;
+        }
+    }
+    int stepSize = 1;
+    long long int cycle = 0;
+    int c = 0;
+    while (c < numCmds && cycle <= maxCycles) {
+        stepperCmd *cmd = &cmds[c];
+        switch (cmd->cmdType) {
+        case STEPCMD_LOOP_START:
+        case STEPCMD_SYNC:
+            c++;
+            break;
+        case STEPCMD_PAUSE:
+            cycle += (cmd->numCycles > 0)?cmd->numCycles:1;
+            c++;
+            break;
+        case STEPCMD_LOOP_STOP:
+            if (--cmd->triggerCounter) {
+                if (cmd->triggerCounter < 0) cmd->triggerCounter = 0;
+                c = cmd->dir;
+            }
+            else {
+                cmd->triggerCounter = cmd->numTriggers;
+                c++;
+            }
+            cycle++;
+            break;
+        case STEPCMD_MOVE:
+        case STEPCMD_MOVE_TO:
+            if (cmd->cmdType == STEPCMD_MOVE_TO && cmd->dir == 0 && !planResolveMoveTo(axis, cycleFreq, cmd, position)) {
+                c++;
+                cycle++;
+                break;
+            }
+            for (;;) {
+                stepPulse pulse;
+                pulse.time = cycle;
+                pulse.dir = cmd->dir;
+                pulse.stepSize = stepSize;
+                pulses.push_back(pulse);
+                cmd->triggerCounter--;
+                if (planStep(axis, cmd, &stepSize, &position) & PLAN_MOVE_DONE) {
+                    cycle++;
+                    c++;
+                    break;
+                }
+                cycle += cmd->numCycles;
+                if (cycle > maxCycles)
+                    break;
+            }
+            break;
+        default:
+            c++;
+        }
+    }
+}
+
+// Pull a motor's step pulses out of the trace, with the direction and step size
+// its other pins say each one was...
+static bool readPulses(const char *path, int motorNum, std::vector<stepPulse> &pulses, long long int *lastTime)
+{
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        fprintf(stderr, "steptiming: can't open %s\n", path);
+        return(false);
+    }
+    int levels[MAX_GPIO_PINS];
+    for (int pin = 0; pin < MAX_GPIO_PINS; pin++)
+        levels[pin] = 0;
+    bool msWired = false;
+    for (int ms = 0; ms < 3; ms++)
+        if (msPins[motorNum][ms] >= 0) msWired = true;
+    long long int time;
+    int pin, value;
+    while (fscanf(fp, "%lld %d %d", &time, &pin, &value) == 3) {
+        *lastTime = time;
+        if (pin < 0 || pin >= MAX_GPIO_PINS)
+            continue;
+        if (pin == stepPins[motorNum] && value && !levels[pin]) {
+            stepPulse pulse;
+            pulse.time = time;
+            pulse.dir = levels[dirPins[motorNum]]?1:-1;
+            pulse.stepSize = 1;
+            if (msWired) {
+                pulse.stepSize = msCoarseRatio;
+                for (int ms = 0; ms < 3; ms++)
+                    if (msPins[motorNum][ms] >= 0 && levels[msPins[motorNum][ms]] != msCoarseLevels[ms])
+                        pulse.stepSize = 1;
+            }
+            pulses.push_back(pulse);
+        }
+        levels[pin] = value;
+    }
+    fclose(fp);
+    return(true);
+}
+
+// Line the real pulses up with the ideal ones and measure how far out they are...
+static void analyse(const std::vector<stepPulse> &ideal, const std::vector<stepPulse> &actual, double cycleFreq,
+                    long long int startPos, bool verbose, int motorNum, motorReport *report)
+{
+    double cycleNS = 1e9 / cycleFreq;
+    memset(report, 0, sizeof(*report));
+    report->numIdeal = ideal.size();
+    report->numActual = actual.size();
+    report->idealEnd = report->actualEnd = startPos;
+    for (size_t s = 0; s < ideal.size(); s++)
+        report->idealEnd += ideal[s].dir * ideal[s].stepSize;
+    for (size_t s = 0; s < actual.size(); s++)
+        report->actualEnd += actual[s].dir * actual[s].stepSize;
+    long int numSteps = std::min(ideal.size(), actual.size());
+    if (numSteps == 0)
+        return;
+    // The first step is where the run started...
+    report->offset = actual[0].time - (long long int)(ideal[0].time * cycleNS + 0.5);
+    std::vector<long long int> absErrors(numSteps);
+    double sum = 0.0, sumSq = 0.0, rippleSq = 0.0;
+    long int numIntervals = 0;
+    for (long int s = 0; s < numSteps; s++) {
+        long long int idealTime = report->offset + (long long int)(ideal[s].time * cycleNS + 0.5);
+        long long int error = actual[s].time - idealTime;
+        sum += error;
+        sumSq += (double)error * (double)error;
+        absErrors[s] = (error < 0)?-error:error;
+        if (absErrors[s] > report->maxError) {
+            report->maxError = absErrors[s];
+            report->maxErrorStep = s;
+        }
+        double ripple = 0.0;
+        if (s > 0) {
+            double idealInterval = (ideal[s].time - ideal[s - 1].time) * cycleNS;
+            double actualInterval = actual[s].time - actual[s - 1].time;
+            ripple = 100.0 * (actualInterval - idealInterval) / idealInterval;
+            rippleSq += ripple * ripple;
+            numIntervals++;
+            if (fabs(ripple) > report->maxRipple) {
+                report->maxRipple = fabs(ripple);
+                report->maxRippleStep = s;
+            }
+        }
+        if (verbose)
+            printf("motor %d step %ld: ideal %lld actual %lld error %lld nS interval %+.1f%%%s\n",
+                   motorNum, s, idealTime, actual[s].time, error, ripple,
+                   (ideal[s].dir != actual[s].dir || ideal[s].stepSize != actual[s].stepSize)?" (MISMATCH)":"");
+    }
+    report->meanError = sum / numSteps;
+    report->rmsError = sqrt(sumSq / numSteps);
+    std::sort(absErrors.begin(), absErrors.end());
+    report->p99Error = absErrors[(numSteps * 99) / 100];
+    report->rmsRipple = numIntervals?sqrt(rippleSq / numIntervals):0.0;
+}
+
+int main(int argc, char *argv[])
+{
+    double cycleFreq = DEFAULT_CYCLE_FREQ;
+    stepAxis axis;
+    axis.stepsPerMM = STEPS_PER_MM;
+    axis.minCyclesPerStep = MIN_LOOPS_PER_STEP;
+    axis.msCruiseCycles = MS_CRUISE_LOOPS_PER_STEP;
+    double startMM[NUM_MOTORS];
+    for (int n = 0; n < NUM_MOTORS; n++)
+        startMM[n] = 0.0;
+    long long int maxError = -1;
+    double maxRipple = -1.0;
+    bool verbose = false;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        const char *opt = argv[arg];
+        if (!strcmp(opt, "-v")) {
+            verbose = true;
+            continue;
+        }
+        if (arg + 1 >= argc)
+            usage();
+        const char *val = argv[++arg];
+        if (!strcmp(opt, "-f")) cycleFreq = atof(val);
+        else if (!strcmp(opt, "-s")) axis.stepsPerMM = atoi(val);
+        else if (!strcmp(opt, "-m")) axis.minCyclesPerStep = atoi(val);
+        else if (!strcmp(opt, "-t")) maxError = atoll(val);
+        else if (!strcmp(opt, "-r")) maxRipple = atof(val);
+        else if (!strcmp(opt, "-p")) {
+            int motorNum;
+            double mm;
+            if (sscanf(val, "%d:%lf", &motorNum, &mm) != 2 || motorNum < 0 || motorNum >= NUM_MOTORS)
+                usage();
+            startMM[motorNum] = mm;
+        }
+        else
+            usage();
+    }
+    if (argc - arg != 2 || cycleFreq <= 0.0 || axis.stepsPerMM <= 0 || axis.minCyclesPerStep <= 0)
+        usage();
+    std::vector<stepperProgramCmd> programs[NUM_MOTORS];
+    if (!readProgram(argv[arg], programs))
+        return(2);
+
+    bool pass = true;
+    long long int firstOffset = 0;
+    bool haveFirst = false;
+    for (int n = 0; n < NUM_MOTORS; n++) {
+        if (programs[n].empty())
+            continue;
+        // Same motor set up as the engine, see the stepper constructor...
+        stepAxis motorAxis = axis;
+        motorAxis.msRatio = 1;
+        for (int ms = 0; ms < 3; ms++)
+            if (msPins[n][ms] >= 0) motorAxis.msRatio = msCoarseRatio;
+        std::vector<stepPulse> actual, ideal;
+        long long int lastTime = 0;
+        if (!readPulses(argv[arg + 1], n, actual, &lastTime))
+            return(2);
+        long long int startPos = (long long int)floor(startMM[n] * axis.stepsPerMM + 0.5);
+        long long int span = actual.empty()?0:(long long int)((lastTime - actual[0].time) * cycleFreq / 1e9);
+        planPulses(&motorAxis, cycleFreq, programs[n], startPos, span + TRAILING_CYCLES, ideal);
+        motorReport report;
+        analyse(ideal, actual, cycleFreq, startPos, verbose, n, &report);
+
+        printf("motor %d: %ld pulses (ideal %ld), ends at %lld steps (ideal %lld)\n",
+               n, report.numActual, report.numIdeal, report.actualEnd, report.idealEnd);
+        if (report.numActual == 0 || report.numIdeal == 0) {
+            pass = pass && (report.numActual == report.numIdeal);
+            continue;
+        }
+        printf("  step time error (nS): mean %.0f rms %.0f p99 %lld max %lld (step %ld)\n",
+               report.meanError, report.rmsError, report.p99Error, report.maxError, report.maxErrorStep);
+        printf("  step interval error: rms %.2f%% max %.2f%% (step %ld)\n",
+               report.rmsRipple, report.maxRipple, report.maxRippleStep);
+        if (haveFirst)
+            printf("  start %lld nS after the first motor\n", report.offset - firstOffset);
+        else {
+            firstOffset = report.offset;
+            haveFirst = true;
+        }
+        if (report.numActual != report.numIdeal || report.actualEnd != report.idealEnd) {
+            printf("  %+ld pulses, %+lld steps out\n", report.numActual - report.numIdeal, report.actualEnd - report.idealEnd);
+            pass = false;
+        }
+        if (maxError >= 0 && report.maxError > maxError)
+            pass = false;
+        if (maxRipple >= 0.0 && report.maxRipple > maxRipple)
+            pass = false;
+    }
+    if (maxError >= 0 || maxRipple >= 0.0) {
+        printf("%s\n", pass?"PASS":"FAIL");
+        return(pass?0:1);
+    }
+    return(0);
+}
@@ -0,0 +1,20 @@
+#-------------------------------------------------
+#
+# Offline check of recorded step pulse timing against the ideal profile
+#
+#-------------------------------------------------
+
+QT       -= core gui
+
+TARGET = steptiming
+TEMPLATE = app
+CONFIG += console
+CONFIG -= qt app_bundle
+
+INCLUDEPATH += ../..
+
+SOURCES += steptiming.cpp
+
+HEADERS  += ../../stepplan.h \
+    ../../machinestate.h \
+    ../../pi_stepper_pins.h